@@ -28,10 +28,16 @@ enum DeviceAnnouncementHeaderEnum {
 	DEVA_ANNOUNCEMENT    = 0x00,
 	DEVA_DESCRIPTION     = 0x01,
 	DEVA_FEATURES        = 0x02,
+	DEVA_STATISTICS      = 0x03,
+	DEVA_NOT_MODIFIED    = 0x04, // Answer to a conditional request, nothing has changed
+	DEVA_FEATURE_FILTER  = 0x05,
 
 	DEVA_QUERY           = 0x10, // Ask for a device announcement packet
 	DEVA_DESCRIBE        = 0x11, // Query device properties
 	DEVA_LIST_FEATURES   = 0x12, // Query device features
+	DEVA_GET_STATISTICS  = 0x13, // Query runtime counters
+	DEVA_QUERY_FILTERED  = 0x14, // Ask for an announcement, only from devices that match a filter
+	DEVA_GET_FEATURE_FILTER = 0x15, // Query the feature filter bitmap
 
 	// Devices agree to specifically notify each other when either restarts
 	// Not implemented for now ... possible future extension
@@ -111,6 +117,54 @@ typedef nx_struct device_feature_request {
 } device_description_request_t;
 #pragma pack(pop)
 
+// Conditional forms of the requests, the requester includes what it has cached
+#pragma pack(push, 1)
+typedef nx_struct device_conditional_request {
+	nx_uint8_t header;             // 0x10 or 0x11
+	nx_uint8_t version;            // Protocol version
+	nx_time64_t ident_timestamp;   // Cached ident_timestamp
+	nx_uint32_t feature_list_hash; // Cached feature_list_hash
+} device_conditional_request_t;
+// 2+8+4=14
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+typedef nx_struct device_conditional_feature_request {
+	nx_uint8_t header;             // 0x12
+	nx_uint8_t version;            // Protocol version
+	nx_uint8_t offset;             // What feature to start from
+	nx_time64_t ident_timestamp;   // Cached ident_timestamp
+	nx_uint32_t feature_list_hash; // Cached feature_list_hash
+} device_conditional_feature_request_t;
+// 3+8+4=15
+#pragma pack(pop)
+
+enum DeviceAnnouncementFilterEnum {
+	DEVA_FILTER_APPLICATION = 0x00, // Application UUID of the device
+	DEVA_FILTER_FEATURE     = 0x01, // One of the features of the device
+};
+
+#pragma pack(push, 1)
+typedef nx_struct device_filtered_request {
+	nx_uint8_t header;             // 0x14
+	nx_uint8_t version;            // Protocol version
+	nx_uint8_t filter;             // What the UUID is compared to, DeviceAnnouncementFilterEnum
+	nx_uuid_t uuid;
+} device_filtered_request_t;
+// 3+16=19
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+typedef nx_struct device_not_modified {
+	nx_uint8_t header;             // 04
+	nx_uint8_t version;            // Protocol version
+	nx_uint8_t guid[8];            // Device EUI64
+	nx_uint32_t boot_number;       // Current boot number
+	nx_uint8_t request;            // Header of the request that is answered
+} device_not_modified_t;
+// 2+8+4+1=15
+#pragma pack(pop)
+
 #pragma pack(push, 1)
 typedef nx_struct device_description_v1 {
 	nx_uint8_t header;             // 00
@@ -169,4 +223,49 @@ typedef nx_struct device_features {
 // 2+8+4+2+0*16=12 -> 2+8+4+2+1*16=28 -> 2+8+4+2+6*16=108
 #pragma pack(pop)
 
+#pragma pack(push, 1)
+typedef nx_struct device_feature_filter {
+	nx_uint8_t header;             // 05
+	nx_uint8_t version;            // Protocol version
+	nx_uint8_t guid[8];            // Device EUI64
+	nx_uint32_t boot_number;       // Current boot number
+
+	nx_uint32_t feature_list_hash; // Hash of the features in the filter
+	nx_uint8_t count;              // Number of features in the filter
+	nx_uint8_t filter[];           // Bloom filter, see DeviceFeatureFilter.h, length from packet length
+} device_feature_filter_t;
+// 2+8+4+4+1+N
+#pragma pack(pop)
+
+#define DEVICE_STATISTICS_VERSION 0x01
+
+#pragma pack(push, 1)
+typedef nx_struct device_statistics {
+	nx_uint8_t header;             // 03
+	nx_uint8_t version;            // Protocol version
+	nx_uint8_t guid[8];            // Device EUI64
+	nx_uint32_t boot_number;       // Current boot number
+
+	nx_uint8_t stats_version;      // Layout of the rest of the packet, 01
+	nx_uint32_t uptime;            // Uptime since boot, seconds
+
+	nx_uint32_t announcements;     // Announcements sent
+	nx_uint32_t responses;         // Responses to requests sent
+	nx_uint32_t suppressed;        // Requests not answered, because an answer was just broadcast
+	nx_uint32_t rate_limited;      // Requests dropped by rate limiting
+	nx_uint32_t queue_overflows;   // Requests dropped, because queues were full
+	nx_uint32_t pool_empty;        // Messages not available from the pool
+	nx_uint32_t send_failures;     // Failed send attempts
+	nx_uint32_t retries;           // Retried sends
+	nx_uint32_t stale;             // Messages given up on
+
+	nx_uint16_t latency_p50;       // Response latency percentiles, milliseconds, 0xFFFF - above the measured range
+	nx_uint16_t latency_p90;
+	nx_uint16_t latency_p99;
+
+	nx_uint16_t stack_free;        // Least free stack space seen for the announcement thread, bytes
+} device_statistics_t;
+// 2+8+4+1+4+9*4+3*2+2=63
+#pragma pack(pop)
+
 #endif // DEVICEANNOUNCEMENTPROTOCOL_H_
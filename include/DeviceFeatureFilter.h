@@ -0,0 +1,65 @@
+/**
+ * Device feature filter, shared by all implementations.
+ *
+ * The filter is a Bloom filter over the feature UUIDs, a bitmap of any length
+ * where DEVICE_FEATURE_FILTER_HASHES bits are set for each feature. The bits
+ * are (h1 + i*h2) modulo the number of bits in the map, for i from 0, where
+ * h1 is the 32-bit FNV-1a hash of the UUID in network byte order and h2 is h1
+ * rotated by 16 bits with the lowest bit set. A test may give false positives,
+ * but never false negatives.
+ *
+ * @license MIT
+ **/
+#ifndef DEVICEFEATUREFILTER_H_
+#define DEVICEFEATUREFILTER_H_
+
+#include <stdbool.h>
+
+#include "DeviceFeatureListHash.h"
+
+#define DEVICE_FEATURE_FILTER_HASHES 3
+
+static inline uint32_t feature_filter_bit (uint32_t h1, uint8_t i, uint16_t length)
+{
+	uint32_t h2 = ((h1 << 16) | (h1 >> 16)) | 1;
+	return (h1 + i*h2) % (8UL*length);
+}
+
+/**
+ * Add a feature to a filter of length bytes.
+ */
+static inline void feature_filter_add (uint8_t * filter, uint16_t length, const nx_uuid_t * feature)
+{
+	uint32_t h1 = feature_list_hash_add(DEVICE_FEATURE_LIST_HASH_OFFSET, feature);
+	uint8_t i;
+	for (i = 0; i < DEVICE_FEATURE_FILTER_HASHES; i++)
+	{
+		uint32_t bit = feature_filter_bit(h1, i, length);
+		filter[bit/8] |= (1 << (bit%8));
+	}
+}
+
+/**
+ * Test if a feature may be in a filter of length bytes.
+ * @return false if the feature is certainly not in the filter.
+ */
+static inline bool feature_filter_test (const uint8_t * filter, uint16_t length, const nx_uuid_t * feature)
+{
+	uint32_t h1 = feature_list_hash_add(DEVICE_FEATURE_LIST_HASH_OFFSET, feature);
+	uint8_t i;
+	if (0 == length)
+	{
+		return false;
+	}
+	for (i = 0; i < DEVICE_FEATURE_FILTER_HASHES; i++)
+	{
+		uint32_t bit = feature_filter_bit(h1, i, length);
+		if (0 == (filter[bit/8] & (1 << (bit%8))))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif // DEVICEFEATUREFILTER_H_
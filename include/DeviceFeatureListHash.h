@@ -0,0 +1,33 @@
+/**
+ * Device feature list hash, shared by all implementations.
+ *
+ * The hash is 32-bit FNV-1a over the feature UUIDs in network byte order,
+ * in the order they are listed by the device. An empty list has hash 0.
+ *
+ * @license MIT
+ **/
+#ifndef DEVICEFEATURELISTHASH_H_
+#define DEVICEFEATURELISTHASH_H_
+
+#include "UniversallyUniqueIdentifier.h"
+
+#define DEVICE_FEATURE_LIST_HASH_EMPTY  0UL
+#define DEVICE_FEATURE_LIST_HASH_OFFSET 0x811C9DC5UL
+#define DEVICE_FEATURE_LIST_HASH_PRIME  0x01000193UL
+
+/**
+ * Add a feature to the hash state. Start with DEVICE_FEATURE_LIST_HASH_OFFSET,
+ * the final state is the hash of a non-empty list.
+ */
+static inline uint32_t feature_list_hash_add (uint32_t state, const nx_uuid_t * feature)
+{
+	const uint8_t * p = (const uint8_t*)feature;
+	uint8_t i;
+	for (i = 0; i < sizeof(nx_uuid_t); i++)
+	{
+		state = (state ^ p[i]) * DEVICE_FEATURE_LIST_HASH_PRIME;
+	}
+	return state;
+}
+
+#endif // DEVICEFEATURELISTHASH_H_
@@ -9,12 +9,80 @@
 #define DEVICE_ANNOUNCEMENT_H_
 
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include "mist_comm.h"
 #include "mist_comm_pool.h"
 
+#include "DeviceAnnouncementProtocol.h"
+
+// How many received requests can be pending for an announcer, must be a power
+// of 2 and no more than 128
+#ifndef DEVA_ACTION_QUEUE_LENGTH
+#define DEVA_ACTION_QUEUE_LENGTH 8
+#endif//DEVA_ACTION_QUEUE_LENGTH
+
+// How many announcements from other devices can be pending for an announcer,
+// must be a power of 2 and no more than 128
+#ifndef DEVA_ANNOUNCEMENT_QUEUE_LENGTH
+#define DEVA_ANNOUNCEMENT_QUEUE_LENGTH 2
+#endif//DEVA_ANNOUNCEMENT_QUEUE_LENGTH
+
+// How many broadcast requests can be waiting for their response time, or
+// any requests for the previous message to be sent, for each announcer
+#ifndef DEVA_DEFERRED_LENGTH
+#define DEVA_DEFERRED_LENGTH 4
+#endif//DEVA_DEFERRED_LENGTH
+
+// How many sources each announcer rate limits separately, see
+// deva_dropped_requests
+#ifndef DEVA_RATE_SOURCES
+#define DEVA_RATE_SOURCES 4
+#endif//DEVA_RATE_SOURCES
+
+// Response latency histogram buckets, upper limits are 10, 50, 100, 250, 500,
+// 1000 and 2500 milliseconds, the last bucket has no limit
+#define DEVA_STATS_LATENCY_BUCKETS 8
+
 typedef struct device_announcer device_announcer_t;
 
+typedef struct device_announcement_listener device_announcement_listener_t;
+
+/**
+ * Counters of an announcer, since it was added.
+ */
+typedef struct deva_stats {
+	uint32_t announcements; // Announcements sent
+	uint32_t queries; // Responses sent, by type of request
+	uint32_t describes;
+	uint32_t feature_lists;
+	uint32_t diagnostics; // Statistics and feature filter responses
+	uint32_t suppressed; // Requests not answered, because a broadcast answer was just sent or nothing had changed
+	uint32_t not_modified; // Conditional requests answered with a not-modified frame
+	uint32_t rate_limited; // Requests dropped by rate limiting
+	uint32_t queue_overflows; // Requests or announcements dropped, because queues were full
+	uint32_t pool_empty; // Times a message could not be taken from the pool
+	uint32_t send_failures; // Send attempts that failed
+	uint32_t retries; // Sends that were retried
+	uint32_t stale; // Messages abandoned at a retry, age or send-done limit, requests too old to answer
+	uint32_t latency[DEVA_STATS_LATENCY_BUCKETS]; // From request to send-done
+} deva_stats_t;
+
+/**
+ * Announcement listener callback. Called from the announcement thread for every
+ * valid announcement received from another device. Version 1 announcements are
+ * upgraded to the current structure before delivery.
+ *
+ * The announcement is read-only, in network byte order and only valid for the
+ * duration of the call, all listeners receive the same instance. Do not add or
+ * remove announcers or listeners from within the callback.
+ *
+ * @param announcement The received announcement.
+ * @param source Address of the device that sent the announcement.
+ * @param user The user pointer given when the listener was added.
+ */
+typedef void deva_listener_f (const device_announcement_t * announcement, am_addr_t source, void * user);
+
 /**
  * Initialize the device announcement module. Call it once after kernel has started.
  *
@@ -30,6 +98,11 @@ bool deva_init (comms_pool_t * p_msg_pool);
  * @param comms A comms layer to use for announcements.
  * @param rctrl An optional comms sleep controller (NULL if layer does not need to be controlled).
  *              The controller must be persistently allocated, but uninitialized.
+ *              Several announcers on the same layer can use the same
+ *              controller, their announcements are then grouped together.
+ *              A controller belongs to one layer, adding it for another
+ *              layer fails, use deva_set_wake_group for announcers on
+ *              different layers of the same radio.
  * @param period_s Announcement period, set to 0 for no announcements.
  * @return true if an announcer was added.
  */
@@ -38,24 +111,131 @@ bool deva_add_announcer(device_announcer_t* announcer,
                         uint32_t period_s);
 
 /**
- * Remove an announcer.
+ * Switch an announcer to Trickle (RFC 6206) mode. The announcement interval
+ * starts at imin_s and doubles up to imax_s. An announcement is suppressed
+ * when k announcements that bring no restart have been heard during the
+ * interval. The interval is reset to imin_s when a neighbor in the neighbor
+ * table has restarted and when announcement content or features change.
+ *
+ * @param announcer A previously registered announcer.
+ * @param imin_s Minimum interval, 0 to go back to periodic announcements.
+ * @param imax_s Maximum interval.
+ * @param k Redundancy constant.
+ * @return true if the announcer was found and the parameters were valid.
+ */
+bool deva_set_trickle(device_announcer_t* announcer, uint16_t imin_s, uint16_t imax_s, uint8_t k);
+
+/**
+ * Put an announcer in a wake group. Periodic announcements of announcers in
+ * the same group are aligned to within DEVA_ALIGN_SLACK_MS, like those of
+ * announcers that share a sleep controller, so that different layers on the
+ * same radio wake it up once.
+ *
+ * @param announcer A previously registered announcer.
+ * @param group Group of the radio, 0 for no group.
+ * @return true if the announcer was found.
+ */
+bool deva_set_wake_group(device_announcer_t* announcer, uint8_t group);
+
+/**
+ * Remove an announcer. If the layer is still sending a message of the
+ * announcer, waits for it for up to DEVA_REMOVE_TIMEOUT_MS. After that the
+ * message is returned to the pool when the layer reports send-done, the
+ * announcer memory is not accessed any more in either case.
  *
  * @param announcer A previously registered announcer.
  * @return true if an announcer was removed.
  */
 bool deva_remove_announcer(device_announcer_t* announcer);
 
+/**
+ * Notify the module that device information included in announcements has
+ * changed. Feature and coordinate changes do not need to be notified, features
+ * are tracked by the module and coordinates are read for every send.
+ */
+void deva_content_changed(void);
+
+/**
+ * Get the counters of an announcer.
+ *
+ * @param announcer A previously registered announcer.
+ * @param stats Memory for a copy of the counters.
+ * @return true if the announcer was found.
+ */
+bool deva_get_stats(device_announcer_t* announcer, deva_stats_t* stats);
+
+/**
+ * Get the number of requests dropped by rate limiting since init, on all
+ * layers. Each announcer limits requests per source with
+ * DEVA_RATE_SOURCE_BURST and DEVA_RATE_SOURCE_INTERVAL_MS and in total with
+ * DEVA_RATE_TOTAL_BURST and DEVA_RATE_TOTAL_INTERVAL_MS.
+ *
+ * @return Number of dropped requests.
+ */
+uint32_t deva_dropped_requests(void);
+
 /**
  * Add a local listener for announcements made by other devices.
- * TODO
+ *
+ * @param listener Memory for a listener, make sure it does not go out of scope!
+ * @param callback Function to call for received announcements.
+ * @param user Pointer passed to the callback.
+ * @return true if the listener was added, false if already registered.
  */
-//bool deva_add_listener(device_announcement_listener_t* listener, callback);
+bool deva_add_listener(device_announcement_listener_t* listener, deva_listener_f* callback, void* user);
 
 /**
  * Remove a previously registered local listener.
- * TODO
+ *
+ * @param listener A previously registered listener.
+ * @return true if the listener was removed.
+ */
+bool deva_remove_listener(device_announcement_listener_t* listener);
+
+/**
+ * You should not access this struct directly from the outside!
+ * A request about this device, passed from the radio thread to the
+ * announcement thread.
+ */
+typedef struct device_announcement_request {
+	uint8_t action; // enum DeviceAnnouncementHeaderEnum
+	uint8_t version;
+	uint8_t offset;
+	bool broadcast;
+	bool conditional; // Only answer if the cached values below are out of date
+	am_addr_t address;
+	uint32_t received; // milliseconds
+	uint32_t feature_list_hash;
+	uint64_t ident_timestamp;
+} device_announcement_request_t;
+
+/**
+ * You should not access this struct directly from the outside!
+ * A request held back until its response time or until the announcer is free.
  */
-//bool deva_remove_listener(device_announcement_listener_t* listener);
+typedef struct device_announcement_deferred {
+	device_announcement_request_t request;
+	uint32_t due; // milliseconds
+} device_announcement_deferred_t;
+
+/**
+ * You should not access this struct directly from the outside!
+ * Token bucket for rate limiting requests.
+ */
+typedef struct device_announcement_bucket {
+	am_addr_t address;
+	uint8_t tokens;
+	uint32_t updated; // milliseconds
+} device_announcement_bucket_t;
+
+/**
+ * You should not access this struct directly from the outside!
+ * An announcement received from another device, upgraded to current version.
+ */
+typedef struct device_announcement_heard {
+	am_addr_t source;
+	device_announcement_t announcement;
+} device_announcement_heard_t;
 
 /**
  * You should not access this struct directly from the outside!
@@ -66,13 +246,83 @@ struct device_announcer {
 	comms_layer_t * comms;
 
 	comms_sleep_controller_t * comms_ctrl;
+	bool ctrl_owner; // comms_ctrl was registered by this announcer, on comms
+	uint8_t wake_group; // Aligned with other announcers in the group, 0 for none
 
-	uint16_t period; // minutes, 0 for never
+	uint16_t period; // seconds, 0 for never
 
-    uint32_t last;
+	uint32_t deadline; // Next announcement, milliseconds
 	uint32_t announcements;
 
 	device_announcer_t * next;
+	device_announcer_t * next_deadline;
+
+	uint16_t trickle_imin; // seconds, 0 when trickle is not used
+	uint16_t trickle_imax; // seconds
+	uint8_t trickle_k;
+	uint8_t trickle_counter;
+	bool trickle_transmit; // deadline is the transmission point, not the end
+	uint32_t trickle_interval; // seconds
+	uint32_t trickle_end; // milliseconds
+
+	uint32_t listen_ms; // How long to keep a sleep-controlled layer on after sending
+	uint32_t sent; // milliseconds
+	bool followed; // A request has arrived since the last send
+
+	comms_msg_t * reserved; // Used before the pool, see DEVA_RESERVED_MESSAGES
+	bool reserved_busy;
+
+	comms_msg_t * msg; // Message being sent, one at a time for each announcer
+	bool msg_announcement; // Periodic announcement, not a response
+	bool msg_sending; // Given to comms, waiting for send-done
+	bool msg_starting; // Waiting for the layer to start
+	bool msg_retry; // Waiting for msg_at to try again
+	uint8_t msg_retries;
+	uint32_t msg_created; // milliseconds
+	uint32_t msg_at; // Start timeout, send-done timeout or retry time, milliseconds
+	uint32_t msg_requested; // When the request was received, milliseconds
+	uint8_t msg_action; // Request answered by the message, DEVA_ANNOUNCEMENT if not recorded
+	uint8_t msg_version;
+	uint8_t msg_offset;
+	am_addr_t msg_destination;
+	volatile bool msg_done; // Set by send-done
+	volatile comms_error_t msg_result;
+	volatile uint32_t msg_done_at; // milliseconds
+
+	bool awake; // Blocking comms_ctrl, for the message and listen_ms after it
+	uint32_t awake_until; // milliseconds, once msg is done
+
+	// Single-producer single-consumer rings from radio_receive to the thread,
+	// heads are written only by the receiver, tails only by the thread
+	device_announcement_request_t requests[DEVA_ACTION_QUEUE_LENGTH];
+	atomic_uint_fast8_t requests_head;
+	atomic_uint_fast8_t requests_tail;
+
+	device_announcement_heard_t heard[DEVA_ANNOUNCEMENT_QUEUE_LENGTH];
+	atomic_uint_fast8_t heard_head;
+	atomic_uint_fast8_t heard_tail;
+
+	// Requests waiting for their response time, only used by the thread
+	device_announcement_deferred_t deferred[DEVA_DEFERRED_LENGTH];
+	uint8_t deferred_count;
+
+	// Rate limiting, only used by radio_receive
+	device_announcement_bucket_t source_buckets[DEVA_RATE_SOURCES];
+	device_announcement_bucket_t total_bucket;
+
+	deva_stats_t stats; // Updated by the announcement thread
+	atomic_uint_least32_t rcv_rate_limited; // Updated by radio_receive, added to stats when read
+	atomic_uint_least32_t rcv_queue_overflows;
+};
+
+/**
+ * You should not access this struct directly from the outside!
+ */
+struct device_announcement_listener {
+	deva_listener_f * callback;
+	void * user;
+
+	device_announcement_listener_t * next;
 };
 
 #endif//DEVICE_ANNOUNCEMENT_H_
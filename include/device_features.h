@@ -13,13 +13,44 @@
 
 #include "UniversallyUniqueIdentifier.h"
 
+// How many features can be added, a hard limit, devf_add_feature fails when it
+// is reached. Readers copy from two module-owned snapshots of DEVF_MAX_FEATURES
+// UUIDs each, so every feature allowed costs 32 bytes of RAM.
+#ifndef DEVF_MAX_FEATURES
+#define DEVF_MAX_FEATURES 64
+#endif//DEVF_MAX_FEATURES
+
+// Size of the feature filter, see DeviceFeatureFilter.h
+#ifndef DEVF_FILTER_BYTES
+#define DEVF_FILTER_BYTES 16
+#endif//DEVF_FILTER_BYTES
+
 typedef struct device_feature device_feature_t;
 
+/**
+ * A consistent view of the feature list properties.
+ */
+typedef struct devf_info {
+	uint32_t generation; // Changes whenever the list changes
+	uint32_t hash;
+	uint8_t count;
+} devf_info_t;
+
 /**
  * Initialize the device features module. Call it once after boot.
+ *
+ * Features may be added and removed from any thread, readers always get a
+ * consistent view of the list. Readers never block and can be used from
+ * receive callbacks.
  */
 void devf_init();
 
+/**
+ * Get feature count, hash and list generation, consistent with each other.
+ * @param info Memory to store the list properties in.
+ */
+void devf_get_info(devf_info_t* info);
+
 /**
  * Get total feature count.
  * @return Feature count.
@@ -27,15 +58,35 @@ void devf_init();
 uint8_t devf_count();
 
 /**
- * Calculate a hash of device features.
+ * Get the hash of device features, see DeviceFeatureListHash.h.
+ * The hash is maintained when features are added and removed.
  * @return Hash of device features.
  */
 uint32_t devf_hash();
 
+/**
+ * Check if a feature is present. The feature filter rules out most absent
+ * features, the snapshot is only scanned when the filter matches. Never
+ * blocks, so it can be used from receive callbacks.
+ * @param ftr Feature UUID to look for.
+ * @return true if the feature is in the list.
+ */
+bool devf_has_feature(const nx_uuid_t* ftr);
+
+/**
+ * Copy the feature filter, a Bloom filter of the features as described in
+ * DeviceFeatureFilter.h. It is maintained when features are added and removed.
+ *
+ * @param filter Memory for DEVF_FILTER_BYTES of filter bitmap.
+ * @param info   Memory to store the list properties in, may be NULL.
+ */
+void devf_get_filter(uint8_t filter[DEVF_FILTER_BYTES], devf_info_t* info);
+
 /**
  * Get device feature based on sequence number.
  *
- * Changes during iteration are not handled.
+ * Features may shift when the list changes between calls, use
+ * devf_get_features for a consistent range.
  *
  * @param fnum Feature sequence number 0...255.
  * @param ftr  UUID struct to store requested feature UUID.
@@ -44,13 +95,24 @@ uint32_t devf_hash();
 bool devf_get_feature(uint8_t fnum, nx_uuid_t* ftr);
 
 /**
- * Add a device feature.
+ * Copy a range of device features. The copied range is always consistent
+ * with the returned list info, any range can be copied without walking the
+ * list from the start.
  *
- * Changes during iteration are not handled.
+ * @param offset Sequence number of the first feature to copy.
+ * @param ftrs   Array to store feature UUIDs in.
+ * @param max    Maximum number of features to copy.
+ * @param info   Memory to store the list properties in, may be NULL.
+ * @return Number of features copied.
+ */
+uint8_t devf_get_features(uint8_t offset, nx_uuid_t ftrs[], uint8_t max, devf_info_t* info);
+
+/**
+ * Add a device feature.
  *
  * @param ftr Memory for feature storage.
  * @param feature Feature UUID to store.
- * @return true if a feature was stored, false if duplicate.
+ * @return true if a feature was stored, false if duplicate or DEVF_MAX_FEATURES reached.
  */
 bool devf_add_feature(device_feature_t* ftr, nx_uuid_t* feature);
 
@@ -58,7 +120,7 @@ bool devf_add_feature(device_feature_t* ftr, nx_uuid_t* feature);
  * Remove feature based on storage pointer.
  *
  * @param ftr Feature memory pointer previously added with add_feature.
- * @return true if a feature was removed and the memory is free.
+ * @return true if a feature was removed, readers no longer refer to the memory.
  */
 bool devf_remove_feature(device_feature_t* ftr);
 
@@ -0,0 +1,110 @@
+/**
+ * Fixed-capacity table of neighbouring devices, built from the announcements
+ * they send and keyed by their EUI64.
+ *
+ * Copyright Thinnect Inc. 2026
+ * @author Raido Pahtma
+ * @license MIT
+ */
+#ifndef DEVICE_NEIGHBORS_H_
+#define DEVICE_NEIGHBORS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mist_comm.h"
+
+#include "DeviceAnnouncementProtocol.h"
+
+// Number of neighbors that can be remembered, must be a power of 2
+#ifndef DEVN_CAPACITY
+#define DEVN_CAPACITY 16
+#endif//DEVN_CAPACITY
+
+/**
+ * Flags describing what changed about a neighbor with an announcement.
+ */
+enum DeviceNeighborChanges {
+	DEVN_CHANGED_NEW      = (1 << 0), // Neighbor was not in the table
+	DEVN_CHANGED_BOOT     = (1 << 1), // Neighbor has rebooted
+	DEVN_CHANGED_IDENT    = (1 << 2), // Application UUID or ident_timestamp changed
+	DEVN_CHANGED_FEATURES = (1 << 3), // Feature list hash changed
+	DEVN_CHANGED_POSITION = (1 << 4), // Position or position type changed
+	DEVN_CHANGED_RADIO    = (1 << 5), // Radio technology or channel changed
+	DEVN_CHANGED_ADDRESS  = (1 << 6)  // Announced from a different address
+};
+
+/**
+ * Neighbor information, all values in host byte order except the UUID.
+ */
+typedef struct device_neighbor {
+	uint8_t guid[8];
+	am_addr_t address;
+
+	uint32_t boot_number;
+	uint32_t announcement;     // Last announcement number
+
+	nx_uuid_t uuid;            // Application UUID
+
+	char position_type;
+	int32_t latitude;
+	int32_t longitude;
+	int32_t elevation;
+
+	uint8_t radio_tech;
+	uint8_t radio_channel;
+
+	int64_t ident_timestamp;
+	uint32_t feature_list_hash;
+
+	uint32_t last_seen;        // Local uptime in seconds when last heard
+} device_neighbor_t;
+
+/**
+ * Initialize the neighbor table. Called by deva_init.
+ */
+void devn_init ();
+
+/**
+ * Store an announcement in the neighbor table. The least recently heard
+ * neighbor is evicted when the table is full.
+ *
+ * @param announcement A received announcement, network byte order.
+ * @param source Address of the device that sent the announcement.
+ * @return DeviceNeighborChanges flags, 0 if nothing changed.
+ */
+uint8_t devn_update (const device_announcement_t * announcement, am_addr_t source);
+
+/**
+ * Look up a neighbor.
+ *
+ * @param guid EUI64 of the neighbor.
+ * @param neighbor Memory to copy the neighbor info to, may be NULL.
+ * @return true if the neighbor is known.
+ */
+bool devn_get (const uint8_t guid[8], device_neighbor_t * neighbor);
+
+/**
+ * Get the number of known neighbors.
+ * @return Neighbor count.
+ */
+uint8_t devn_count ();
+
+/**
+ * Iterate over known neighbors. The order is unspecified.
+ *
+ * @param index Iteration position, set to 0 to start iterating.
+ * @param neighbor Memory to copy the next neighbor info to.
+ * @return true if a neighbor was returned, false when iteration has ended.
+ */
+bool devn_next (uint8_t * index, device_neighbor_t * neighbor);
+
+/**
+ * Forget neighbors that have not been heard from for some time.
+ *
+ * @param max_age_s Maximum age of an entry in seconds.
+ * @return Number of neighbors removed.
+ */
+uint8_t devn_expire (uint32_t max_age_s);
+
+#endif//DEVICE_NEIGHBORS_H_
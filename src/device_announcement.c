@@ -8,11 +8,14 @@
 #include "DeviceAnnouncementProtocol.h"
 #include "device_announcement.h"
 #include "device_features.h"
+#include "device_neighbors.h"
 #include "DeviceSignature.h"
 
 #include <time.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 
 #include "node_lifetime.h"
 #include "node_coordinates.h"
@@ -34,56 +37,217 @@
 #define DEVA_MIN_PERIOD_S 10
 #define DEVA_MAX_PERIOD_S (365*24*3600)
 
+// Random delay added to every periodic announcement
+#ifndef DEVA_ANNOUNCEMENT_JITTER_MS
+#define DEVA_ANNOUNCEMENT_JITTER_MS 250
+#endif//DEVA_ANNOUNCEMENT_JITTER_MS
+
+// How long to keep a sleep-controlled layer on after sending, the window is
+// adjusted for each announcer based on when follow-up requests arrive
+#ifndef DEVA_LISTEN_WINDOW_MS
+#define DEVA_LISTEN_WINDOW_MS 1000
+#endif//DEVA_LISTEN_WINDOW_MS
+
+#ifndef DEVA_LISTEN_MIN_MS
+#define DEVA_LISTEN_MIN_MS 50
+#endif//DEVA_LISTEN_MIN_MS
+
+#ifndef DEVA_LISTEN_MAX_MS
+#define DEVA_LISTEN_MAX_MS 5000
+#endif//DEVA_LISTEN_MAX_MS
+
+// Announcers sharing a sleep controller are moved to each other's deadlines
+// when they are this close, so that the radio is started once for all
+#ifndef DEVA_ALIGN_SLACK_MS
+#define DEVA_ALIGN_SLACK_MS 2000
+#endif//DEVA_ALIGN_SLACK_MS
+
+// How long to wait for a sleep-controlled layer to start before giving up
+#ifndef DEVA_RADIO_START_TIMEOUT_MS
+#define DEVA_RADIO_START_TIMEOUT_MS 5000
+#endif//DEVA_RADIO_START_TIMEOUT_MS
+
+// How long deva_remove_announcer waits for the layer to finish sending, the
+// message is left to send-done after that
+#ifndef DEVA_REMOVE_TIMEOUT_MS
+#define DEVA_REMOVE_TIMEOUT_MS DEVA_RADIO_START_TIMEOUT_MS
+#endif//DEVA_REMOVE_TIMEOUT_MS
+
+// How long to wait for send-done before the message is left to it and the
+// announcer moves on
+#ifndef DEVA_SEND_DONE_TIMEOUT_MS
+#define DEVA_SEND_DONE_TIMEOUT_MS DEVA_REMOVE_TIMEOUT_MS
+#endif//DEVA_SEND_DONE_TIMEOUT_MS
+
+// How many messages of removed announcers or timed out sends can be waiting
+// for send-done
+#ifndef DEVA_ORPHANED_MESSAGES
+#define DEVA_ORPHANED_MESSAGES 2
+#endif//DEVA_ORPHANED_MESSAGES
+
+// Take a message from the pool for each announcer when it is added, so that
+// announcements and responses do not depend on the pool being available
+#ifndef DEVA_RESERVED_MESSAGES
+#define DEVA_RESERVED_MESSAGES 0
+#endif//DEVA_RESERVED_MESSAGES
+
+// Failed sends are retried after an exponentially growing delay, until the
+// retry or the age limit for the kind of message is reached
+#ifndef DEVA_RETRY_BACKOFF_MS
+#define DEVA_RETRY_BACKOFF_MS 20
+#endif//DEVA_RETRY_BACKOFF_MS
+
+#ifndef DEVA_RETRY_BACKOFF_MAX_MS
+#define DEVA_RETRY_BACKOFF_MAX_MS 1000
+#endif//DEVA_RETRY_BACKOFF_MAX_MS
+
+#ifndef DEVA_RETRY_LIMIT_ANNOUNCEMENT
+#define DEVA_RETRY_LIMIT_ANNOUNCEMENT 5
+#endif//DEVA_RETRY_LIMIT_ANNOUNCEMENT
+
+#ifndef DEVA_RETRY_AGE_ANNOUNCEMENT_MS
+#define DEVA_RETRY_AGE_ANNOUNCEMENT_MS 10000
+#endif//DEVA_RETRY_AGE_ANNOUNCEMENT_MS
+
+#ifndef DEVA_RETRY_LIMIT_RESPONSE
+#define DEVA_RETRY_LIMIT_RESPONSE 3
+#endif//DEVA_RETRY_LIMIT_RESPONSE
+
+#ifndef DEVA_RETRY_AGE_RESPONSE_MS
+#define DEVA_RETRY_AGE_RESPONSE_MS 2000
+#endif//DEVA_RETRY_AGE_RESPONSE_MS
+
+// Broadcast requests are answered after a random delay, the window grows with
+// the number of neighbors that are likely to be answering at the same time
+#ifndef DEVA_RESPONSE_WINDOW_MIN_MS
+#define DEVA_RESPONSE_WINDOW_MIN_MS 100
+#endif//DEVA_RESPONSE_WINDOW_MIN_MS
+
+#ifndef DEVA_RESPONSE_WINDOW_PER_NEIGHBOR_MS
+#define DEVA_RESPONSE_WINDOW_PER_NEIGHBOR_MS 20
+#endif//DEVA_RESPONSE_WINDOW_PER_NEIGHBOR_MS
+
+#ifndef DEVA_RESPONSE_WINDOW_MAX_MS
+#define DEVA_RESPONSE_WINDOW_MAX_MS 2000
+#endif//DEVA_RESPONSE_WINDOW_MAX_MS
+
+// Identical requests within this time get a single broadcast response
+#ifndef DEVA_RESPONSE_CACHE_MS
+#define DEVA_RESPONSE_CACHE_MS 2000
+#endif//DEVA_RESPONSE_CACHE_MS
+
+// How many recent responses are remembered
+#ifndef DEVA_RESPONSE_CACHE_LENGTH
+#define DEVA_RESPONSE_CACHE_LENGTH 4
+#endif//DEVA_RESPONSE_CACHE_LENGTH
+
+// Requests are rate limited per source and in total for each announcer with
+// token buckets, a token is added every INTERVAL and at most BURST can be
+// saved up, DEVA_RATE_SOURCES is in device_announcement.h
+#ifndef DEVA_RATE_SOURCE_BURST
+#define DEVA_RATE_SOURCE_BURST 4
+#endif//DEVA_RATE_SOURCE_BURST
+
+#ifndef DEVA_RATE_SOURCE_INTERVAL_MS
+#define DEVA_RATE_SOURCE_INTERVAL_MS 2000
+#endif//DEVA_RATE_SOURCE_INTERVAL_MS
+
+#ifndef DEVA_RATE_TOTAL_BURST
+#define DEVA_RATE_TOTAL_BURST 16
+#endif//DEVA_RATE_TOTAL_BURST
+
+#ifndef DEVA_RATE_TOTAL_INTERVAL_MS
+#define DEVA_RATE_TOTAL_INTERVAL_MS 250
+#endif//DEVA_RATE_TOTAL_INTERVAL_MS
+
+// Deferred requests that have not been answered by this age are dropped,
+// DEVA_DEFERRED_LENGTH is in device_announcement.h
+#ifndef DEVA_DEFERRED_AGE_MS
+#define DEVA_DEFERRED_AGE_MS (DEVA_RESPONSE_WINDOW_MAX_MS + DEVA_RETRY_AGE_RESPONSE_MS)
+#endif//DEVA_DEFERRED_AGE_MS
+
 /**
- * A structure for communicating data or actions from radio thread
- * into the announcement thread.
+ * A recently sent response to a request.
  **/
-typedef struct announcement_action {
+typedef struct response_record {
 	device_announcer_t * p_anc;
-
 	enum DeviceAnnouncementHeaderEnum action;
+	uint8_t version;
+	uint8_t offset;
+	am_addr_t address; // AM_BROADCAST_ADDR if everyone got it
+	uint32_t sent; // milliseconds
+} response_record_t;
 
-	comms_msg_t * p_msg; // For incoming messages with context that might need to be forwarded
 
-	// For requests about this device
-	struct {
-		am_addr_t address;
-		uint8_t version;
-		uint8_t offset;
-	} request;
-} announcement_action_t;
+/**
+ * A request being handled by the announcement thread.
+ **/
+typedef struct device_announcement_action {
+	device_announcer_t * p_anc;
+	device_announcement_request_t request;
+} device_announcement_action_t;
 
+// Ring indexes are uint8_t counters that wrap, so they must wrap with the rings
+_Static_assert((DEVA_ACTION_QUEUE_LENGTH <= 128) && (0 == (DEVA_ACTION_QUEUE_LENGTH & (DEVA_ACTION_QUEUE_LENGTH - 1))),
+               "DEVA_ACTION_QUEUE_LENGTH must be a power of 2, no more than 128");
+_Static_assert((DEVA_ANNOUNCEMENT_QUEUE_LENGTH <= 128) && (0 == (DEVA_ANNOUNCEMENT_QUEUE_LENGTH & (DEVA_ANNOUNCEMENT_QUEUE_LENGTH - 1))),
+               "DEVA_ANNOUNCEMENT_QUEUE_LENGTH must be a power of 2, no more than 128");
 
 #define ANNC_FLAG_SNT (1 << 0)
 #define ANNC_FLAG_RCV (1 << 1)
 #define ANNC_FLAG_NEW (1 << 2)
-#define ANNC_FLAGS    (   0x7)
-
-
-// How often the announcement module is polled
-#define DEVICE_ANNOUNCEMENT_POLL_PERIOD_S 60
+#define ANNC_FLAG_STR (1 << 3)
+#define ANNC_FLAGS    (   0xF)
 
 extern uint8_t radio_channel (void); // TODO header
 
-static comms_msg_t * handle_action (const announcement_action_t * aa);
+static device_announcer_t * find_announcer (device_announcer_t * p_anc);
+static comms_msg_t * handle_action (const device_announcement_action_t * aa);
+static void handle_heard (device_announcer_t * p_anc, const device_announcement_heard_t * p_dh);
 static comms_msg_t * announce (device_announcer_t * an, uint8_t version, am_addr_t destination);
+static comms_msg_t * not_modified (device_announcer_t * an, uint8_t version, am_addr_t destination, uint8_t request);
+static uint8_t adjust_version (uint8_t version);
 
 static void radio_status_changed (comms_layer_t * comms, comms_status_t status, void * user);
 static void radio_send_done (comms_layer_t * comms, comms_msg_t * msg, comms_error_t result, void * user);
+static bool orphan_message (device_announcer_t * p_anc);
+static void wait_send_done (device_announcer_t * p_anc);
 static void radio_receive (comms_layer_t * comms, const comms_msg_t * msg, void * user);
 
 
 static device_announcer_t * mp_announcers;
+static device_announcer_t * mp_schedule; // Announcers ordered by deadline
+static device_announcement_listener_t * mp_listeners;
 
 static time_t m_boot_time;
 
 static osMutexId_t m_mutex;
 static osThreadId_t m_thread_id;
 
-static osMessageQueueId_t m_action_queue;
+
+// Send-done of an announcer that is being removed, see deva_remove_announcer
+static osMutexId_t m_orphan_mutex;
+static osSemaphoreId_t m_sent_sem;
+static comms_msg_t * m_orphans[DEVA_ORPHANED_MESSAGES];
+
+static response_record_t m_responses[DEVA_RESPONSE_CACHE_LENGTH];
+
+static atomic_uint_least32_t m_requests_dropped; // By rate limiting, on any layer
 
 static comms_pool_t * mp_pool;
-static comms_msg_t * mp_msg;
+
+// Pre-serialized messages, rebuilt when m_content_version changes
+static atomic_uint_fast32_t m_content_version;
+static uint32_t m_templates_version;
+static device_announcement_v1_t m_announcement_v1;
+static device_announcement_v2_t m_announcement_v2;
+static device_description_v1_t m_description_v1;
+static device_description_v2_t m_description_v2;
+
+
+// Own content last seen by trickle announcers, a change resets intervals
+static uint32_t m_trickle_version;
+static uint32_t m_trickle_hash;
 
 
 static void nx_uuid_application (nx_uuid_t * uuid)
@@ -92,6 +256,27 @@ static void nx_uuid_application (nx_uuid_t * uuid)
 }
 
 
+/**
+ * Check if a filtered query is meant for this device. Called from
+ * radio_receive, so it must never block, devf_has_feature only reads the
+ * published feature snapshot.
+ **/
+static bool filter_matches (const device_filtered_request_t * p_fr)
+{
+	switch (p_fr->filter)
+	{
+		case DEVA_FILTER_APPLICATION:
+			return 0 == memcmp(&(p_fr->uuid), UUID_APPLICATION_BYTES, sizeof(nx_uuid_t));
+		case DEVA_FILTER_FEATURE:
+			return devf_has_feature(&(p_fr->uuid));
+		default:
+			debug1("flt %u", (unsigned int)p_fr->filter);
+		break;
+	}
+	return false;
+}
+
+
 static uint32_t next_announcement (uint32_t announcements, uint16_t period)
 {
 	uint32_t next = period;
@@ -119,342 +304,1821 @@ static void update_boot_time (void)
 		if (((time_t)-1) != now)
 		{
 			m_boot_time = now - osCounterGetSecond();
+			deva_content_changed();
 		}
 	}
 }
 
 
-static void allow_sleep (void)
+/**
+ * Requests are the same when they come from the same source and would get the
+ * same answer, a request that has one of these pending adds nothing.
+ **/
+static bool same_request (const device_announcement_request_t * p_a, const device_announcement_request_t * p_b)
+{
+	return (p_a->action == p_b->action)
+	     &&(p_a->address == p_b->address)
+	     &&(p_a->version == p_b->version)
+	     &&(p_a->offset == p_b->offset)
+	     &&(p_a->broadcast == p_b->broadcast)
+	     &&(p_a->conditional == p_b->conditional)
+	     &&(( ! p_a->conditional)
+	       ||((p_a->ident_timestamp == p_b->ident_timestamp)
+	        &&(p_a->feature_list_hash == p_b->feature_list_hash)));
+}
+
+
+/**
+ * Check if the same request is already waiting in the announcer's ring, called
+ * only by the producer. Entries between tail and head are not written while
+ * they are pending, an entry that the consumer takes during the scan is being
+ * answered after the new request arrived, so it still covers it.
+ **/
+static bool request_pending (device_announcer_t * p_anc, const device_announcement_request_t * p_req)
 {
-	device_announcer_t * p_anc = mp_announcers;
-	while (NULL != p_anc)
+	uint_fast8_t head = atomic_load_explicit(&(p_anc->requests_head), memory_order_relaxed);
+	uint_fast8_t tail = atomic_load_explicit(&(p_anc->requests_tail), memory_order_acquire);
+
+	for (uint8_t i = (uint8_t)tail; i != (uint8_t)head; i++)
 	{
-		if (NULL != p_anc->comms_ctrl)
+		if (same_request(p_req, &(p_anc->requests[i % DEVA_ACTION_QUEUE_LENGTH])))
 		{
-			comms_sleep_allow(p_anc->comms_ctrl);
+			return true;
 		}
-		p_anc = p_anc->next;
 	}
+	return false;
 }
 
 
-static device_announcer_t * get_pending_announcer (uint32_t * timeout_s)
+/**
+ * Put a request into the announcer's ring, called only from the receive
+ * callback of the announcer's comms layer, so there is a single producer.
+ * Returns false if the ring is full, was_empty tells if the consumer may
+ * have run out of work and needs to be woken.
+ **/
+static bool push_request (device_announcer_t * p_anc, const device_announcement_request_t * p_req, bool * p_was_empty)
 {
-	uint32_t now = osCounterGetSecond();
-	device_announcer_t * p_anc = mp_announcers;
-	while (NULL != p_anc)
+	uint_fast8_t head = atomic_load_explicit(&(p_anc->requests_head), memory_order_relaxed);
+	uint_fast8_t tail = atomic_load_explicit(&(p_anc->requests_tail), memory_order_acquire);
+
+	if ((uint8_t)(head - tail) >= DEVA_ACTION_QUEUE_LENGTH)
 	{
-		// Limit period to "reasonable" values to not break calculations
-		if ((p_anc->period >= DEVA_MIN_PERIOD_S) && (p_anc->period <= DEVA_MAX_PERIOD_S))
-		{
-		    uint32_t next = p_anc->last + next_announcement(p_anc->announcements, p_anc->period);
-		    if (next <= now)
-		    {
-				return p_anc;
-		    }
-		    else
-		    {
-		    	uint32_t remaining = next - now;
-		    	if (remaining < *timeout_s)
-		    	{
-		    		*timeout_s = remaining;
-		    	}
-		    }
-		}
-		p_anc = p_anc->next;
+		return false;
 	}
-	return NULL;
+
+	p_anc->requests[head % DEVA_ACTION_QUEUE_LENGTH] = *p_req;
+	atomic_store_explicit(&(p_anc->requests_head), (uint8_t)(head + 1), memory_order_release);
+
+	*p_was_empty = (head == tail);
+	return true;
 }
 
 
-static uint32_t process_announcements (uint32_t flags, uint32_t current_timeout_s)
+/**
+ * Take the next request from the announcer's ring, only the announcement
+ * thread consumes.
+ **/
+static bool pop_request (device_announcer_t * p_anc, device_announcement_request_t * p_req)
 {
-	uint32_t timeout_s = current_timeout_s;
-	device_announcer_t * p_anc = NULL;
+	uint_fast8_t tail = atomic_load_explicit(&(p_anc->requests_tail), memory_order_relaxed);
+	uint_fast8_t head = atomic_load_explicit(&(p_anc->requests_head), memory_order_acquire);
 
-	update_boot_time();
-
-	if (ANNC_FLAG_SNT & flags)
+	if (head == tail)
 	{
-		comms_pool_put(mp_pool, mp_msg);
-		mp_msg = NULL;
+		return false;
 	}
 
-	if (NULL != mp_msg)
+	*p_req = p_anc->requests[tail % DEVA_ACTION_QUEUE_LENGTH];
+	atomic_store_explicit(&(p_anc->requests_tail), (uint8_t)(tail + 1), memory_order_release);
+	return true;
+}
+
+
+/**
+ * Put a received announcement into the announcer's ring, single producer like
+ * push_request.
+ **/
+static bool push_heard (device_announcer_t * p_anc, const device_announcement_heard_t * p_dh, bool * p_was_empty)
+{
+	uint_fast8_t head = atomic_load_explicit(&(p_anc->heard_head), memory_order_relaxed);
+	uint_fast8_t tail = atomic_load_explicit(&(p_anc->heard_tail), memory_order_acquire);
+
+	if ((uint8_t)(head - tail) >= DEVA_ANNOUNCEMENT_QUEUE_LENGTH)
 	{
-		return timeout_s;
+		return false;
 	}
 
-	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+	p_anc->heard[head % DEVA_ANNOUNCEMENT_QUEUE_LENGTH] = *p_dh;
+	atomic_store_explicit(&(p_anc->heard_head), (uint8_t)(head + 1), memory_order_release);
+
+	*p_was_empty = (head == tail);
+	return true;
+}
 
-	if (NULL == mp_msg)
+
+/**
+ * Take the next received announcement from the announcer's ring. Announcements
+ * that have a newer one from the same source waiting behind them are skipped.
+ **/
+static bool pop_heard (device_announcer_t * p_anc, device_announcement_heard_t * p_dh)
+{
+	for (;;)
 	{
-		announcement_action_t aa;
-		if (osOK == osMessageQueueGet(m_action_queue, &aa, NULL, 0))
-		{
-			// Check that the announcer is valid (has not been removed for example)
-			p_anc = mp_announcers;
-			while (NULL != p_anc)
-			{
-				if (p_anc == aa.p_anc)
-				{
-					break;
-				}
-				p_anc = p_anc->next;
-			}
+		uint_fast8_t tail = atomic_load_explicit(&(p_anc->heard_tail), memory_order_relaxed);
+		uint_fast8_t head = atomic_load_explicit(&(p_anc->heard_head), memory_order_acquire);
+		const device_announcement_heard_t * p_first = &(p_anc->heard[tail % DEVA_ANNOUNCEMENT_QUEUE_LENGTH]);
+		bool merged = false;
 
-			if (NULL != p_anc)
-			{
-				mp_msg = handle_action(&aa);
-				if (NULL != aa.p_msg)
-				{
-					comms_pool_put(mp_pool, aa.p_msg); // Release the message
-				}
-			}
-			else
-			{
-				err1("p %p", aa.p_anc);
-			}
+		if (head == tail)
+		{
+			return false;
 		}
-	}
 
-	if (NULL == mp_msg)
-	{
-		p_anc = get_pending_announcer(&timeout_s);
-		if (NULL != p_anc)
+		for (uint8_t i = (uint8_t)(tail + 1); i != (uint8_t)head; i++)
 		{
-			debug1("annc %p", p_anc);
-			mp_msg = announce(p_anc, DEVICE_ANNOUNCEMENT_VERSION, AM_BROADCAST_ADDR);
-			if (NULL != mp_msg)
-			{
-				p_anc->last = osCounterGetSecond();
-				p_anc->announcements++;
-			}
-			else
+			if (p_first->source == p_anc->heard[i % DEVA_ANNOUNCEMENT_QUEUE_LENGTH].source)
 			{
-				warn1("msg");
+				merged = true;
+				break;
 			}
-			timeout_s = DEVICE_ANNOUNCEMENT_POLL_PERIOD_S;
 		}
-	}
 
-	if (NULL != mp_msg)
-	{
-		if (NULL != p_anc->comms_ctrl)
+		if ( ! merged)
 		{
-			comms_sleep_block(p_anc->comms_ctrl);
-			while (COMMS_STARTED != comms_status(p_anc->comms));
-			timeout_s = 1; // Leave comms on for 1 second
+			*p_dh = *p_first;
 		}
 
-		comms_error_t err = comms_send(p_anc->comms, mp_msg, radio_send_done, NULL);
-		logger(COMMS_SUCCESS == err ? LOG_DEBUG1: LOG_WARN1, "snd=%u", err);
-		if (COMMS_SUCCESS != err)
+		atomic_store_explicit(&(p_anc->heard_tail), (uint8_t)(tail + 1), memory_order_release);
+
+		if ( ! merged)
 		{
-			comms_pool_put(mp_pool, mp_msg);
-			mp_msg = NULL;
+			return true;
 		}
+		debug1("mrg %04"PRIX16, p_first->source);
 	}
-	else if (0 == flags) // A timeout just happened and we have nothing to do
+}
+
+
+static void bucket_refill (device_announcement_bucket_t * p_tb, uint8_t burst, uint32_t interval, uint32_t now)
+{
+	uint32_t added = (now - p_tb->updated) / interval;
+	if (p_tb->tokens + added >= burst)
 	{
-		allow_sleep();
-		debug1("sleep %"PRIu32, timeout_s);
+		p_tb->tokens = burst;
+		p_tb->updated = now;
 	}
 	else
 	{
-		debug1("flgs %"PRIx32" sleep %"PRIu32, flags, timeout_s);
+		p_tb->tokens += added;
+		p_tb->updated += added * interval;
 	}
-
-	osMutexRelease(m_mutex);
-
-	return timeout_s;
 }
 
 
-static void announcement_loop (void * arg)
+/**
+ * Check if a request from the source fits into the rate limits, called from
+ * the radio receive callback before anything gets queued. The buckets belong
+ * to the announcer and only its receive callback uses them, so nothing is
+ * locked.
+ **/
+static bool request_allowed (device_announcer_t * p_anc, am_addr_t source)
 {
-	uint32_t timeout_s = DEVICE_ANNOUNCEMENT_POLL_PERIOD_S;
+	uint32_t now = osCounterGetMilli();
+	device_announcement_bucket_t * p_tb = NULL;
+	bool allowed = false;
 
-	for (;;)
+	for (uint8_t i = 0; i < DEVA_RATE_SOURCES; i++)
 	{
-		uint32_t flags = osThreadFlagsWait(ANNC_FLAGS, osFlagsWaitAny, timeout_s * 1000UL + 1);
+		if (p_anc->source_buckets[i].address == source)
+		{
+			p_tb = &(p_anc->source_buckets[i]);
+			bucket_refill(p_tb, DEVA_RATE_SOURCE_BURST, DEVA_RATE_SOURCE_INTERVAL_MS, now);
+			break;
+		}
+	}
 
-		if (osFlagsErrorTimeout == flags)
+	if (NULL == p_tb) // Reuse the bucket that has been idle the longest
+	{
+		p_tb = &(p_anc->source_buckets[0]);
+		for (uint8_t i = 1; i < DEVA_RATE_SOURCES; i++)
 		{
-			flags = 0;
+			if ((now - p_anc->source_buckets[i].updated) > (now - p_tb->updated))
+			{
+				p_tb = &(p_anc->source_buckets[i]);
+			}
 		}
+		p_tb->address = source;
+		p_tb->tokens = DEVA_RATE_SOURCE_BURST;
+		p_tb->updated = now;
+	}
 
-		timeout_s = process_announcements(flags, timeout_s);
+	bucket_refill(&(p_anc->total_bucket), DEVA_RATE_TOTAL_BURST, DEVA_RATE_TOTAL_INTERVAL_MS, now);
+
+	if ((p_tb->tokens > 0) && (p_anc->total_bucket.tokens > 0))
+	{
+		p_tb->tokens--;
+		p_anc->total_bucket.tokens--;
+		allowed = true;
 	}
+	else
+	{
+		atomic_fetch_add_explicit(&m_requests_dropped, 1, memory_order_relaxed);
+	}
+
+	return allowed;
 }
 
 
-bool deva_init (comms_pool_t * p_pool)
+static uint32_t response_window (void)
 {
-	mp_announcers = NULL;
-	m_boot_time = ((time_t)-1);
-
-	mp_pool = p_pool;
-	mp_msg = NULL;
-
-	const osMutexAttr_t annc_mutex_attr = { "annc", osMutexPrioInherit, NULL, 0U };
-	m_mutex = osMutexNew(&annc_mutex_attr);
-	if (NULL == m_mutex)
+	uint32_t window = DEVA_RESPONSE_WINDOW_MIN_MS
+	                + DEVA_RESPONSE_WINDOW_PER_NEIGHBOR_MS * devn_count();
+	if (window > DEVA_RESPONSE_WINDOW_MAX_MS)
 	{
-		return false;
+		window = DEVA_RESPONSE_WINDOW_MAX_MS;
 	}
+	return window;
+}
 
-	m_action_queue = osMessageQueueNew(1, sizeof(announcement_action_t), NULL);
-	if (NULL == m_action_queue)
-	{
-    	osMutexDelete(m_mutex);
-    	m_mutex = NULL;
-		return false;
-	}
 
-    const osThreadAttr_t annc_thread_attr = { .name = "annc", .stack_size = 1536 };
-    m_thread_id = osThreadNew(announcement_loop, NULL, &annc_thread_attr);
-    if (NULL == m_thread_id)
-    {
-    	osMessageQueueDelete(m_action_queue);
-    	m_action_queue = NULL;
-    	osMutexDelete(m_mutex);
-    	m_mutex = NULL;
-    	return false;
-    }
-    return true;
+static bool same_condition (const device_announcement_request_t * p_a, const device_announcement_request_t * p_b)
+{
+	return (p_a->conditional && p_b->conditional)
+	     &&(p_a->ident_timestamp == p_b->ident_timestamp)
+	     &&(p_a->feature_list_hash == p_b->feature_list_hash);
 }
 
 
-bool deva_add_announcer (device_announcer_t * p_anc,
-	comms_layer_t * p_comms, comms_sleep_controller_t * p_rctrl,
-	uint32_t period_s)
+/**
+ * Hold a broadcast request until a random point in the response window, or
+ * any request until the announcer has finished sending its previous message.
+ * Returns false if the request should be handled right away.
+ **/
+static bool defer_action (const device_announcement_action_t * p_aa, uint32_t now)
 {
-	p_anc->comms = p_comms;
-	p_anc->comms_ctrl = p_rctrl;
-	p_anc->period = period_s;
-	p_anc->last = osCounterGetSecond() - (rand() % next_announcement(0, p_anc->period));
-	p_anc->announcements = 0;
-	p_anc->next = NULL;
+	device_announcer_t * p_anc = p_aa->p_anc;
+	uint32_t window = 0;
 
-	if (COMMS_SUCCESS != comms_register_recv(p_comms, &(p_anc->rcvr),
-		radio_receive, p_anc, AMID_DEVICE_ANNOUNCEMENT))
+	if (p_aa->request.broadcast)
+	{
+		window = response_window();
+	}
+
+	if ((NULL == p_anc->msg) && (0 == window))
 	{
-		err1("regr");
 		return false;
 	}
 
-	if (NULL != p_rctrl)
+	for (uint8_t i = 0; i < p_anc->deferred_count; i++)
 	{
-		if (COMMS_SUCCESS != comms_register_sleep_controller(p_comms, p_rctrl, radio_status_changed, NULL))
+		device_announcement_request_t * p_pending = &(p_anc->deferred[i].request);
+		if ((p_pending->action == p_aa->request.action)
+		  &&(p_pending->version == p_aa->request.version)
+		  &&(p_pending->offset == p_aa->request.offset))
 		{
-			err1("rctrl");
+			if (p_pending->address != p_aa->request.address)
+			{
+				p_pending->address = AM_BROADCAST_ADDR; // One answer for all
+				p_pending->conditional = false; // Not-modified is never broadcast
+			}
+			if ( ! same_condition(p_pending, &(p_aa->request)))
+			{
+				p_pending->conditional = false; // Someone needs the full answer
+			}
+			return true;
 		}
 	}
 
-	if ((period_s >= DEVA_MIN_PERIOD_S) && (period_s <= DEVA_MAX_PERIOD_S))
+	if (p_anc->deferred_count < DEVA_DEFERRED_LENGTH)
 	{
-		debug1("annc %p nxt %d", p_anc, p_anc->last + next_announcement(0, p_anc->period) - osCounterGetSecond());
+		device_announcement_deferred_t * p_dfr = &(p_anc->deferred[p_anc->deferred_count]);
+		p_dfr->request = p_aa->request;
+		p_dfr->due = now;
+		if (window > 0)
+		{
+			p_dfr->due += rand() % window;
+		}
+		debug1("dfr %04"PRIX16" %"PRIu32, p_aa->request.address, p_dfr->due - now);
+		p_anc->deferred_count++;
 	}
-	else
+	else // Not popped from the ring when full, so only if merging did not fit
 	{
-		debug1("annc %p nvr", p_anc);
+		warn1("dfr %04"PRIX16, p_aa->request.address);
+		p_anc->stats.queue_overflows++;
 	}
+	return true;
+}
 
 
-	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+static void remove_deferred_action (device_announcer_t * p_anc, uint8_t i)
+{
+	p_anc->deferred_count--;
+	memmove(&(p_anc->deferred[i]), &(p_anc->deferred[i + 1]),
+	        (p_anc->deferred_count - i) * sizeof(device_announcement_deferred_t));
+}
 
-	device_announcer_t** pp_announcers = &mp_announcers;
-	while (NULL != *pp_announcers)
+
+/**
+ * Get a deferred request of the announcer that is due, if the announcer is
+ * free to send. Requests older than DEVA_DEFERRED_AGE_MS are dropped.
+ **/
+static bool pop_deferred_action (device_announcer_t * p_anc, device_announcement_action_t * p_aa, uint32_t now)
+{
+	uint8_t i = 0;
+	while (i < p_anc->deferred_count)
 	{
-		pp_announcers = &((*pp_announcers)->next);
+		device_announcement_deferred_t * p_dfr = &(p_anc->deferred[i]);
+		if ((now - p_dfr->request.received) >= DEVA_DEFERRED_AGE_MS)
+		{
+			warn1("dfr old %04"PRIX16, p_dfr->request.address);
+			p_anc->stats.stale++;
+			remove_deferred_action(p_anc, i);
+			continue;
+		}
+		if ((NULL == p_anc->msg) && ((int32_t)(now - p_dfr->due) >= 0))
+		{
+			p_aa->p_anc = p_anc;
+			p_aa->request = p_dfr->request;
+			remove_deferred_action(p_anc, i);
+			return true;
+		}
+		i++;
 	}
-	*pp_announcers = p_anc;
-
-	osMutexRelease(m_mutex);
-
-	osThreadFlagsSet(m_thread_id, ANNC_FLAG_NEW);
-
-	return true;
+	return false;
 }
 
 
-bool deva_remove_announcer (device_announcer_t * p_anc)
+static response_record_t * find_response (device_announcer_t * p_anc, uint8_t action, uint8_t version, uint8_t offset)
 {
-	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
-
-	device_announcer_t** pp_announcers = &mp_announcers;
-	while (NULL != *pp_announcers)
+	for (uint8_t i = 0; i < DEVA_RESPONSE_CACHE_LENGTH; i++)
 	{
-		if (p_anc == *pp_announcers)
+		response_record_t * p_rr = &m_responses[i];
+		if ((NULL != p_rr->p_anc)
+		  &&(p_rr->p_anc == p_anc)
+		  &&(p_rr->action == action)
+		  &&(p_rr->version == version)
+		  &&(p_rr->offset == offset))
 		{
-			*pp_announcers = (*pp_announcers)->next;
+			return p_rr;
+		}
+	}
+	return NULL;
+}
 
-			osMutexRelease(m_mutex); // Removed, rest of teardown is independent
 
-			if (NULL != p_anc->comms_ctrl)
+/**
+ * Record the response the announcer has just sent, a response that never got
+ * through must not suppress anything.
+ **/
+static void record_response (device_announcer_t * p_anc, uint32_t now)
+{
+	response_record_t * p_rr = find_response(p_anc, p_anc->msg_action, p_anc->msg_version, p_anc->msg_offset);
+	if (NULL == p_rr) // Take a free slot or replace the oldest record
+	{
+		p_rr = &m_responses[0];
+		for (uint8_t i = 0; i < DEVA_RESPONSE_CACHE_LENGTH; i++)
+		{
+			if (NULL == m_responses[i].p_anc)
 			{
-				if (COMMS_SUCCESS != comms_deregister_sleep_controller(p_anc->comms, p_anc->comms_ctrl))
-				{
-					sys_panic("drc");
-				}
+				p_rr = &m_responses[i];
+				break;
 			}
-
-			if (COMMS_SUCCESS != comms_deregister_recv(p_anc->comms, &(p_anc->rcvr)))
+			if ((now - m_responses[i].sent) > (now - p_rr->sent))
 			{
-				sys_panic("drr");
+				p_rr = &m_responses[i];
 			}
-
-			return true;
 		}
-		pp_announcers = &((*pp_announcers)->next);
 	}
 
-	osMutexRelease(m_mutex);
-	return false;
+	p_rr->p_anc = p_anc;
+	p_rr->action = p_anc->msg_action;
+	p_rr->version = p_anc->msg_version;
+	p_rr->offset = p_anc->msg_offset;
+	p_rr->address = p_anc->msg_destination;
+	p_rr->sent = now;
 }
 
 
-static comms_msg_t * announce (device_announcer_t * an, uint8_t version, am_addr_t destination)
+/**
+ * Check if what a conditional request has cached is still current.
+ **/
+static bool content_unchanged (const device_announcement_action_t * p_aa)
 {
-	comms_msg_t * msg = comms_pool_get(mp_pool, 0);
-	if (NULL != msg)
+	switch (p_aa->request.action)
 	{
-		uint8_t length = 0;
-		comms_init_message(an->comms, msg);
-		if (1 == version)
-		{
-			device_announcement_v1_t * anc = (device_announcement_v1_t*)comms_get_payload(an->comms, msg, sizeof(device_announcement_v1_t));
-			if (NULL != anc)
-			{
-				coordinates_geo_t geo;
-
-				anc->header = DEVA_ANNOUNCEMENT;
-				anc->version = DEVICE_ANNOUNCEMENT_VERSION;
-				sigGetEui64((uint8_t*)anc->guid);
-				anc->boot_number = hton32(node_lifetime_boots());
+		case DEVA_QUERY:
+			return (IDENT_TIMESTAMP == p_aa->request.ident_timestamp)
+			     &&(devf_hash() == p_aa->request.feature_list_hash);
+		case DEVA_DESCRIBE:
+			return IDENT_TIMESTAMP == p_aa->request.ident_timestamp;
+		case DEVA_LIST_FEATURES:
+			return devf_hash() == p_aa->request.feature_list_hash;
+		default:
+		break;
+	}
+	return false;
+}
 
-				anc->boot_time = hton64(m_boot_time);
-				anc->uptime = hton32(osCounterGetSecond());
-				anc->lifetime = hton32(node_lifetime_seconds());
-				anc->announcement = hton32(an->announcements);
 
-				nx_uuid_application(&(anc->uuid));
+/**
+ * Handle a request, consulting recent responses. A conditional request whose
+ * cached values are current is answered with not-modified, only ever to the
+ * requester. Otherwise a request that was just answered with a broadcast is
+ * skipped, a request that was just answered for someone else gets a broadcast
+ * answer.
+ **/
+static comms_msg_t * handle_request (device_announcement_action_t * p_aa, uint32_t now)
+{
+	device_announcer_t * p_anc = p_aa->p_anc;
+	comms_msg_t * p_msg;
 
-				if (node_coordinates_get(&geo))
-				{
-					anc->latitude = hton32(geo.latitude);
-					anc->longitude = hton32(geo.longitude);
-					anc->elevation = hton32(geo.elevation);
-				}
-				else
+	if (p_aa->request.conditional && content_unchanged(p_aa))
+	{
+		if ((p_aa->request.broadcast) || (AM_BROADCAST_ADDR == p_aa->request.address))
+		{
+			debug1("nm %04"PRIX16" %02X", p_aa->request.address, (unsigned int)p_aa->request.action);
+			p_aa->p_anc->stats.suppressed++;
+			return NULL;
+		}
+		p_msg = not_modified(p_aa->p_anc, adjust_version(p_aa->request.version), p_aa->request.address, p_aa->request.action);
+		if (NULL != p_msg)
+		{
+			p_anc->msg_action = DEVA_ANNOUNCEMENT; // Not recorded, others may still need the full answer
+			p_anc->stats.not_modified++;
+		}
+		return p_msg;
+	}
+
+	response_record_t * p_rr = find_response(p_anc, p_aa->request.action, p_aa->request.version, p_aa->request.offset);
+	if ((NULL != p_rr) && ((now - p_rr->sent) < DEVA_RESPONSE_CACHE_MS))
+	{
+		if (AM_BROADCAST_ADDR == p_rr->address)
+		{
+			debug1("skp %04"PRIX16" %02X", p_aa->request.address, (unsigned int)p_aa->request.action);
+			p_aa->p_anc->stats.suppressed++;
+			return NULL;
+		}
+		if (p_rr->address != p_aa->request.address)
+		{
+			p_aa->request.address = AM_BROADCAST_ADDR;
+		}
+	}
+
+	p_msg = handle_action(p_aa);
+
+	if (NULL != p_msg)
+	{
+		p_anc->msg_action = p_aa->request.action; // Recorded when sent
+		p_anc->msg_version = p_aa->request.version;
+		p_anc->msg_offset = p_aa->request.offset;
+		p_anc->msg_destination = p_aa->request.address;
+		switch (p_aa->request.action)
+		{
+			case DEVA_QUERY:
+				p_aa->p_anc->stats.queries++;
+			break;
+			case DEVA_DESCRIBE:
+				p_aa->p_anc->stats.describes++;
+			break;
+			case DEVA_LIST_FEATURES:
+				p_aa->p_anc->stats.feature_lists++;
+			break;
+			case DEVA_GET_STATISTICS:
+			case DEVA_GET_FEATURE_FILTER:
+				p_aa->p_anc->stats.diagnostics++;
+			break;
+			default:
+			break;
+		}
+	}
+
+	return p_msg;
+}
+
+
+// Another announcer using the same sleep controller, always on the same layer
+static device_announcer_t * find_ctrl_sharer (device_announcer_t * p_anc)
+{
+	for (device_announcer_t * p_a = mp_announcers; NULL != p_a; p_a = p_a->next)
+	{
+		if ((p_a != p_anc) && (p_a->comms_ctrl == p_anc->comms_ctrl))
+		{
+			return p_a;
+		}
+	}
+	return NULL;
+}
+
+
+static comms_msg_t * get_message (device_announcer_t * p_anc)
+{
+	if ((NULL != p_anc->reserved) && ( ! p_anc->reserved_busy))
+	{
+		p_anc->reserved_busy = true;
+		return p_anc->reserved;
+	}
+
+	comms_msg_t * p_msg = comms_pool_get(mp_pool, 0);
+	if (NULL == p_msg)
+	{
+		p_anc->stats.pool_empty++;
+	}
+	return p_msg;
+}
+
+
+static void put_message (comms_msg_t * p_msg)
+{
+	for (device_announcer_t * p_a = mp_announcers; NULL != p_a; p_a = p_a->next)
+	{
+		if (p_msg == p_a->reserved)
+		{
+			p_a->reserved_busy = false;
+			return;
+		}
+	}
+	comms_pool_put(mp_pool, p_msg); // Also reserved messages of removed announcers
+}
+
+
+static device_announcer_t * find_announcer (device_announcer_t * p_anc)
+{
+	device_announcer_t * p_a = mp_announcers;
+	while (NULL != p_a)
+	{
+		if (p_a == p_anc)
+		{
+			return p_a;
+		}
+		p_a = p_a->next;
+	}
+	return NULL;
+}
+
+
+// Some announcer is still keeping the layer of the controller on
+static bool ctrl_awake (comms_sleep_controller_t * p_ctrl)
+{
+	for (device_announcer_t * p_a = mp_announcers; NULL != p_a; p_a = p_a->next)
+	{
+		if ((p_a->awake) && (p_a->comms_ctrl == p_ctrl))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// Time comparisons are relative to now to survive counter overflow
+static bool deadline_passed (uint32_t deadline, uint32_t now)
+{
+	return (int32_t)(now - deadline) >= 0;
+}
+
+
+static void schedule_insert (device_announcer_t * p_anc, uint32_t now)
+{
+	device_announcer_t ** pp_anc = &mp_schedule;
+	while ((NULL != *pp_anc)
+	     &&((int32_t)((*pp_anc)->deadline - now) <= (int32_t)(p_anc->deadline - now)))
+	{
+		pp_anc = &((*pp_anc)->next_deadline);
+	}
+	p_anc->next_deadline = *pp_anc;
+	*pp_anc = p_anc;
+}
+
+
+static void schedule_remove (device_announcer_t * p_anc)
+{
+	device_announcer_t ** pp_anc = &mp_schedule;
+	while (NULL != *pp_anc)
+	{
+		if (p_anc == *pp_anc)
+		{
+			*pp_anc = p_anc->next_deadline;
+			break;
+		}
+		pp_anc = &((*pp_anc)->next_deadline);
+	}
+	p_anc->next_deadline = NULL;
+}
+
+
+// Announcers that wake the same radio, through a controller or a group
+static bool same_wake_group (device_announcer_t * p_a, device_announcer_t * p_b)
+{
+	if ((NULL != p_a->comms_ctrl) && (p_a->comms_ctrl == p_b->comms_ctrl))
+	{
+		return true;
+	}
+	return (0 != p_a->wake_group) && (p_a->wake_group == p_b->wake_group);
+}
+
+
+/**
+ * Move a periodic deadline to the earliest deadline of another announcer
+ * in the same wake group, if it is within the slack.
+ **/
+static void align_deadline (device_announcer_t * p_anc)
+{
+#if DEVA_ALIGN_SLACK_MS > 0
+	if ((NULL == p_anc->comms_ctrl) && (0 == p_anc->wake_group))
+	{
+		return;
+	}
+	for (device_announcer_t * p_a = mp_schedule; NULL != p_a; p_a = p_a->next_deadline)
+	{
+		if ((p_a != p_anc) && (same_wake_group(p_a, p_anc)))
+		{
+			int32_t diff = (int32_t)(p_a->deadline - p_anc->deadline);
+			if ((diff >= -DEVA_ALIGN_SLACK_MS) && (diff <= DEVA_ALIGN_SLACK_MS))
+			{
+				debug1("algn %p %p %"PRIi32, p_anc, p_a, diff);
+				p_anc->deadline = p_a->deadline;
+				break;
+			}
+		}
+	}
+#endif//DEVA_ALIGN_SLACK_MS
+}
+
+
+static void schedule_next (device_announcer_t * p_anc, uint32_t now)
+{
+	// Announcement being sent is counted once sent, but the next one follows it
+	uint32_t next = next_announcement(p_anc->announcements + 1, p_anc->period) * 1000UL;
+#if DEVA_ANNOUNCEMENT_JITTER_MS > 0
+	next += rand() % DEVA_ANNOUNCEMENT_JITTER_MS;
+#endif//DEVA_ANNOUNCEMENT_JITTER_MS
+
+	p_anc->deadline += next; // Keep to the schedule
+	if (deadline_passed(p_anc->deadline, now))
+	{
+		p_anc->deadline = now + next; // Fell behind, do not burst to catch up
+	}
+	align_deadline(p_anc);
+	schedule_insert(p_anc, now);
+}
+
+
+// Announcers that are still sending are left in place until they are done
+static device_announcer_t * pop_due_announcer (uint32_t now)
+{
+	device_announcer_t ** pp_anc = &mp_schedule;
+	while ((NULL != *pp_anc) && (deadline_passed((*pp_anc)->deadline, now)))
+	{
+		device_announcer_t * p_anc = *pp_anc;
+		if (NULL == p_anc->msg)
+		{
+			*pp_anc = p_anc->next_deadline;
+			p_anc->next_deadline = NULL;
+			return p_anc;
+		}
+		pp_anc = &(p_anc->next_deadline);
+	}
+	return NULL;
+}
+
+
+/**
+ * Start a new trickle interval, the transmission point is picked randomly
+ * from the second half of the interval.
+ **/
+static void trickle_start_interval (device_announcer_t * p_anc, uint32_t now)
+{
+	uint32_t interval = p_anc->trickle_interval * 1000UL;
+	p_anc->trickle_counter = 0;
+	p_anc->trickle_transmit = true;
+	p_anc->trickle_end = now + interval;
+	p_anc->deadline = now + interval / 2 + rand() % (interval / 2);
+	schedule_insert(p_anc, now);
+}
+
+
+static void trickle_reset (device_announcer_t * p_anc, uint32_t now)
+{
+	if ((0 != p_anc->trickle_imin) && (p_anc->trickle_interval != p_anc->trickle_imin))
+	{
+		debug1("trst %p", p_anc);
+		schedule_remove(p_anc);
+		p_anc->trickle_interval = p_anc->trickle_imin;
+		trickle_start_interval(p_anc, now);
+	}
+}
+
+
+static void trickle_check_content (uint32_t now)
+{
+	uint32_t hash = devf_hash();
+	uint32_t version = atomic_load(&m_content_version);
+	if ((m_trickle_version != version) || (m_trickle_hash != hash))
+	{
+		m_trickle_version = version;
+		m_trickle_hash = hash;
+		for (device_announcer_t * p_anc = mp_announcers; NULL != p_anc; p_anc = p_anc->next)
+		{
+			trickle_reset(p_anc, now);
+		}
+	}
+}
+
+
+/**
+ * Trickle announcer deadline, either the transmission point or the end of
+ * the interval. Returns true if an announcement should be sent.
+ **/
+static bool trickle_fired (device_announcer_t * p_anc, uint32_t now)
+{
+	if (p_anc->trickle_transmit)
+	{
+		p_anc->trickle_transmit = false;
+		p_anc->deadline = p_anc->trickle_end;
+		schedule_insert(p_anc, now);
+		if (p_anc->trickle_counter < p_anc->trickle_k)
+		{
+			return true;
+		}
+		debug1("sprs %p %u", p_anc, (unsigned int)p_anc->trickle_counter);
+		return false;
+	}
+
+	p_anc->trickle_interval *= 2;
+	if (p_anc->trickle_interval > p_anc->trickle_imax)
+	{
+		p_anc->trickle_interval = p_anc->trickle_imax;
+	}
+	trickle_start_interval(p_anc, now);
+	return false;
+}
+
+
+static uint32_t earlier_timeout (uint32_t timeout, uint32_t deadline, uint32_t now)
+{
+	int32_t remaining = (int32_t)(deadline - now);
+	if (remaining <= 0)
+	{
+		return 0;
+	}
+	if ((uint32_t)remaining < timeout)
+	{
+		return remaining;
+	}
+	return timeout;
+}
+
+
+/**
+ * Let the layers sleep once the listen windows of the announcers have passed,
+ * a controller shared by several announcers is released by the last one.
+ **/
+static void allow_sleep (uint32_t now)
+{
+	for (device_announcer_t * p_anc = mp_announcers; NULL != p_anc; p_anc = p_anc->next)
+	{
+		if ((p_anc->awake) && (NULL == p_anc->msg) && (deadline_passed(p_anc->awake_until, now)))
+		{
+			p_anc->awake = false;
+			if ( ! ctrl_awake(p_anc->comms_ctrl))
+			{
+				comms_sleep_allow(p_anc->comms_ctrl);
+			}
+		}
+	}
+}
+
+
+// Send-done wakes the thread, the send-done timeout is there for stuck layers
+static uint32_t next_timeout (uint32_t now)
+{
+	uint32_t timeout = osWaitForever;
+
+	for (device_announcer_t * p_anc = mp_announcers; NULL != p_anc; p_anc = p_anc->next)
+	{
+		if ((p_anc->msg_starting) || (p_anc->msg_retry) || (p_anc->msg_sending))
+		{
+			timeout = earlier_timeout(timeout, p_anc->msg_at, now);
+		}
+		else if (NULL == p_anc->msg)
+		{
+			if (p_anc->awake)
+			{
+				timeout = earlier_timeout(timeout, p_anc->awake_until, now);
+			}
+			for (uint8_t i = 0; i < p_anc->deferred_count; i++)
+			{
+				timeout = earlier_timeout(timeout, p_anc->deferred[i].due, now);
+			}
+		}
+	}
+
+	for (device_announcer_t * p_anc = mp_schedule; NULL != p_anc; p_anc = p_anc->next_deadline)
+	{
+		if (NULL == p_anc->msg)
+		{
+			timeout = earlier_timeout(timeout, p_anc->deadline, now);
+			break;
+		}
+	}
+
+	return timeout;
+}
+
+
+/**
+ * A request arrived after something was sent, make sure the listen window
+ * would have been long enough to catch it, with some margin.
+ **/
+static void listen_followup (device_announcer_t * p_anc, uint32_t now)
+{
+	uint32_t delay = now - p_anc->sent;
+	if (( ! p_anc->followed) && (delay <= DEVA_LISTEN_MAX_MS))
+	{
+		uint32_t window = 2 * delay + DEVA_LISTEN_MIN_MS;
+		if (window > DEVA_LISTEN_MAX_MS)
+		{
+			window = DEVA_LISTEN_MAX_MS;
+		}
+		if (window > p_anc->listen_ms)
+		{
+			p_anc->listen_ms = window;
+		}
+		p_anc->followed = true;
+		debug1("lstn %p %"PRIu32, p_anc, p_anc->listen_ms);
+	}
+}
+
+
+/**
+ * Something is sent, nothing following the previous send shortens the window.
+ **/
+static void listen_sent (device_announcer_t * p_anc, uint32_t now)
+{
+	if ( ! p_anc->followed)
+	{
+		p_anc->listen_ms -= p_anc->listen_ms / 4;
+		if (p_anc->listen_ms < DEVA_LISTEN_MIN_MS)
+		{
+			p_anc->listen_ms = DEVA_LISTEN_MIN_MS;
+		}
+	}
+	p_anc->followed = false;
+	p_anc->sent = now;
+}
+
+
+// Upper limits of the latency histogram buckets, the last one is open-ended
+static const uint32_t m_latency_limits_ms[DEVA_STATS_LATENCY_BUCKETS - 1] = {
+	10, 50, 100, 250, 500, 1000, 2500
+};
+
+
+static void record_latency (device_announcer_t * p_anc, uint32_t latency_ms)
+{
+	uint8_t i;
+	for (i = 0; i < DEVA_STATS_LATENCY_BUCKETS - 1; i++)
+	{
+		if (latency_ms < m_latency_limits_ms[i])
+		{
+			break;
+		}
+	}
+	p_anc->stats.latency[i]++;
+}
+
+
+static void drop_message (device_announcer_t * p_anc)
+{
+	put_message(p_anc->msg);
+	p_anc->msg = NULL;
+	p_anc->msg_sending = false;
+	p_anc->msg_starting = false;
+	p_anc->msg_retry = false;
+}
+
+
+/**
+ * Keep a message that could not be sent for another attempt, unless it has
+ * been retried too many times or has become too old to be useful.
+ **/
+static void retry_message (device_announcer_t * p_anc, uint32_t now)
+{
+	uint8_t limit = DEVA_RETRY_LIMIT_RESPONSE;
+	uint32_t age = DEVA_RETRY_AGE_RESPONSE_MS;
+	uint32_t backoff;
+
+	if (p_anc->msg_announcement)
+	{
+		limit = DEVA_RETRY_LIMIT_ANNOUNCEMENT;
+		age = DEVA_RETRY_AGE_ANNOUNCEMENT_MS;
+	}
+
+	if ((p_anc->msg_retries >= limit) || ((now - p_anc->msg_created) >= age))
+	{
+		warn1("drop %p %u", p_anc, (unsigned int)p_anc->msg_retries);
+		p_anc->stats.stale++;
+		drop_message(p_anc);
+		return;
+	}
+
+	backoff = DEVA_RETRY_BACKOFF_MS << p_anc->msg_retries;
+	if (backoff > DEVA_RETRY_BACKOFF_MAX_MS)
+	{
+		backoff = DEVA_RETRY_BACKOFF_MAX_MS;
+	}
+	p_anc->msg_retries++;
+	p_anc->stats.retries++;
+	p_anc->msg_retry = true;
+	p_anc->msg_at = now + backoff / 2 + rand() % (backoff / 2 + 1);
+	debug1("rtry %p %u", p_anc, (unsigned int)p_anc->msg_retries);
+}
+
+
+static void send_message (device_announcer_t * p_anc, uint32_t now)
+{
+	if (0 == p_anc->msg_retries)
+	{
+		listen_sent(p_anc, now);
+	}
+
+	p_anc->msg_done = false;
+	comms_error_t err = comms_send(p_anc->comms, p_anc->msg, radio_send_done, p_anc);
+	logger(COMMS_SUCCESS == err ? LOG_DEBUG1: LOG_WARN1, "snd=%u", err);
+	if (COMMS_SUCCESS == err)
+	{
+		p_anc->msg_sending = true;
+		p_anc->msg_at = now + DEVA_SEND_DONE_TIMEOUT_MS;
+	}
+	else
+	{
+		p_anc->stats.send_failures++;
+		retry_message(p_anc, now);
+	}
+}
+
+
+/**
+ * Send right away if the layer is running, otherwise ask it to start and
+ * send when radio_status_changed reports that it has.
+ **/
+static void start_send (device_announcer_t * p_anc, uint32_t now)
+{
+	if (NULL != p_anc->comms_ctrl)
+	{
+		comms_sleep_block(p_anc->comms_ctrl);
+		p_anc->awake = true; // Until listen_ms after the message is done
+		p_anc->awake_until = now;
+		if (COMMS_STARTED != comms_status(p_anc->comms))
+		{
+			debug1("strt %p", p_anc);
+			p_anc->msg_starting = true;
+			p_anc->msg_at = now + DEVA_RADIO_START_TIMEOUT_MS;
+			return;
+		}
+	}
+	send_message(p_anc, now);
+}
+
+
+static void continue_start (device_announcer_t * p_anc, uint32_t now)
+{
+	if (COMMS_STARTED == comms_status(p_anc->comms))
+	{
+		p_anc->msg_starting = false;
+		send_message(p_anc, now);
+	}
+	else if (deadline_passed(p_anc->msg_at, now))
+	{
+		warn1("strt %p", p_anc);
+		p_anc->stats.stale++;
+		drop_message(p_anc);
+	}
+}
+
+
+/**
+ * The layer has not reported send-done in DEVA_SEND_DONE_TIMEOUT_MS, leave the
+ * message to radio_send_done and let the announcer get on with other requests.
+ **/
+static void send_timeout (device_announcer_t * p_anc, uint32_t now)
+{
+	if ( ! orphan_message(p_anc))
+	{
+		if ( ! p_anc->msg_done) // Otherwise handled on the next wakeup
+		{
+			err1("orph full");
+			p_anc->msg_at = now + DEVA_SEND_DONE_TIMEOUT_MS;
+		}
+		return;
+	}
+
+	warn1("sdto %p %p", p_anc, p_anc->msg);
+	if (p_anc->msg == p_anc->reserved) // Goes to the pool with send-done
+	{
+		p_anc->reserved = NULL;
+		p_anc->reserved_busy = false;
+	}
+	p_anc->msg = NULL;
+	p_anc->msg_sending = false;
+	p_anc->stats.stale++;
+}
+
+
+/**
+ * A new message has been produced for the announcer, which must not have a
+ * message already.
+ **/
+static void new_message (device_announcer_t * p_anc, comms_msg_t * p_msg, bool announcement,
+                         uint32_t requested, uint32_t now)
+{
+	p_anc->msg = p_msg;
+	p_anc->msg_announcement = announcement;
+	p_anc->msg_retries = 0;
+	p_anc->msg_created = now;
+	p_anc->msg_requested = requested;
+	p_anc->msg_sending = false;
+	p_anc->msg_starting = false;
+	p_anc->msg_retry = false;
+	start_send(p_anc, now);
+}
+
+
+static void complete_send (device_announcer_t * p_anc, uint32_t now)
+{
+	p_anc->msg_done = false;
+	p_anc->msg_sending = false;
+	p_anc->awake_until = now + p_anc->listen_ms; // Leave comms on for responses
+	if (COMMS_SUCCESS == p_anc->msg_result)
+	{
+		if (p_anc->msg_announcement)
+		{
+			p_anc->announcements++; // Counted only when actually sent
+			p_anc->stats.announcements++;
+		}
+		else
+		{
+			record_latency(p_anc, p_anc->msg_done_at - p_anc->msg_requested);
+			if (DEVA_ANNOUNCEMENT != p_anc->msg_action)
+			{
+				record_response(p_anc, p_anc->msg_done_at);
+			}
+		}
+		drop_message(p_anc);
+	}
+	else
+	{
+		p_anc->stats.send_failures++;
+		retry_message(p_anc, now);
+	}
+}
+
+
+static uint32_t process_announcements (uint32_t flags)
+{
+	uint32_t timeout_ms;
+	uint32_t now;
+	device_announcer_t * p_anc = NULL;
+
+	update_boot_time();
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	now = osCounterGetMilli();
+
+	// Each announcer has its own message, completion is flagged in the
+	// announcer and layer status is checked on every wakeup
+	for (p_anc = mp_announcers; NULL != p_anc; p_anc = p_anc->next)
+	{
+		if (p_anc->msg_done)
+		{
+			complete_send(p_anc, now);
+		}
+		if (p_anc->msg_starting)
+		{
+			continue_start(p_anc, now);
+		}
+		else if ((p_anc->msg_retry) && (deadline_passed(p_anc->msg_at, now)))
+		{
+			p_anc->msg_retry = false;
+			start_send(p_anc, now);
+		}
+		else if ((p_anc->msg_sending) && (deadline_passed(p_anc->msg_at, now)))
+		{
+			send_timeout(p_anc, now);
+		}
+	}
+
+	// Deferred requests whose response time has come go before new ones, new
+	// requests for announcers that are busy are deferred, and are left in the
+	// ring while there is no room for that
+	for (p_anc = mp_announcers; NULL != p_anc; p_anc = p_anc->next)
+	{
+		device_announcement_heard_t dh;
+		device_announcement_action_t aa;
+		bool more;
+		uint8_t i;
+
+		for (i = 0; (i < DEVA_ANNOUNCEMENT_QUEUE_LENGTH) && (pop_heard(p_anc, &dh)); i++)
+		{
+			handle_heard(p_anc, &dh);
+		}
+		more = (DEVA_ANNOUNCEMENT_QUEUE_LENGTH == i);
+
+		while (pop_deferred_action(p_anc, &aa, now))
+		{
+			comms_msg_t * p_msg = handle_request(&aa, now);
+			if (NULL != p_msg)
+			{
+				new_message(p_anc, p_msg, false, aa.request.received, now);
+			}
+		}
+
+		aa.p_anc = p_anc;
+		for (i = 0; (i < DEVA_ACTION_QUEUE_LENGTH)
+		          &&(p_anc->deferred_count < DEVA_DEFERRED_LENGTH)
+		          &&(pop_request(p_anc, &(aa.request))); i++)
+		{
+			listen_followup(p_anc, now);
+
+			if ( ! defer_action(&aa, now))
+			{
+				comms_msg_t * p_msg = handle_request(&aa, now);
+				if (NULL != p_msg)
+				{
+					new_message(p_anc, p_msg, false, aa.request.received, now);
+				}
+			}
+		}
+		more = more || (DEVA_ACTION_QUEUE_LENGTH == i);
+
+		if (more) // Producer kept up, come back for the rest
+		{
+			osThreadFlagsSet(m_thread_id, ANNC_FLAG_RCV);
+		}
+	}
+
+	trickle_check_content(now);
+
+	// Announcers that are due, if they are not busy with something else
+	while (NULL != (p_anc = pop_due_announcer(now)))
+	{
+		comms_msg_t * p_msg = NULL;
+
+		if (0 != p_anc->trickle_imin)
+		{
+			if (trickle_fired(p_anc, now))
+			{
+				debug1("annc %p", p_anc);
+				p_msg = announce(p_anc, DEVICE_ANNOUNCEMENT_VERSION, AM_BROADCAST_ADDR);
+				if (NULL == p_msg)
+				{
+					warn1("msg"); // Skipped, next chance in the next interval
+				}
+			}
+		}
+		else
+		{
+			debug1("annc %p", p_anc);
+			p_msg = announce(p_anc, DEVICE_ANNOUNCEMENT_VERSION, AM_BROADCAST_ADDR);
+			if (NULL != p_msg)
+			{
+				schedule_next(p_anc, now);
+			}
+			else
+			{
+				warn1("msg");
+				p_anc->deadline = now + 1000UL; // Try again in a bit
+				schedule_insert(p_anc, now);
+				break;
+			}
+		}
+
+		if (NULL != p_msg)
+		{
+			new_message(p_anc, p_msg, true, now, now);
+		}
+	}
+
+	allow_sleep(now);
+
+	timeout_ms = next_timeout(now);
+
+	debug1("flgs %"PRIx32" sleep %"PRIu32, flags, timeout_ms);
+
+	osMutexRelease(m_mutex);
+
+	return timeout_ms;
+}
+
+
+static void announcement_loop (void * arg)
+{
+	uint32_t timeout_ms = osWaitForever;
+
+	for (;;)
+	{
+		if (osWaitForever != timeout_ms)
+		{
+			timeout_ms++; // Make sure the deadline has passed when woken
+		}
+
+		uint32_t flags = osThreadFlagsWait(ANNC_FLAGS, osFlagsWaitAny, timeout_ms);
+
+		if (osFlagsErrorTimeout == flags)
+		{
+			flags = 0;
+		}
+
+		timeout_ms = process_announcements(flags);
+	}
+}
+
+
+bool deva_init (comms_pool_t * p_pool)
+{
+	mp_announcers = NULL;
+	mp_schedule = NULL;
+	mp_listeners = NULL;
+	m_boot_time = ((time_t)-1);
+
+	mp_pool = p_pool;
+
+	memset(m_responses, 0, sizeof(m_responses));
+	memset(m_orphans, 0, sizeof(m_orphans));
+
+	atomic_store(&m_requests_dropped, 0);
+
+	atomic_store(&m_content_version, 1);
+	m_templates_version = 0; // Built on first use
+
+	m_trickle_version = atomic_load(&m_content_version);
+	m_trickle_hash = devf_hash();
+
+
+	devn_init();
+
+	const osMutexAttr_t annc_mutex_attr = { "annc", osMutexPrioInherit, NULL, 0U };
+	m_mutex = osMutexNew(&annc_mutex_attr);
+	if (NULL == m_mutex)
+	{
+		return false;
+	}
+
+	const osMutexAttr_t orphan_mutex_attr = { "ano", osMutexPrioInherit, NULL, 0U };
+	m_orphan_mutex = osMutexNew(&orphan_mutex_attr);
+	m_sent_sem = osSemaphoreNew(1, 0, NULL);
+	if ((NULL == m_orphan_mutex)||(NULL == m_sent_sem))
+	{
+		if (NULL != m_orphan_mutex)
+		{
+			osMutexDelete(m_orphan_mutex);
+			m_orphan_mutex = NULL;
+		}
+		if (NULL != m_sent_sem)
+		{
+			osSemaphoreDelete(m_sent_sem);
+			m_sent_sem = NULL;
+		}
+		osMutexDelete(m_mutex);
+		m_mutex = NULL;
+		return false;
+	}
+
+    const osThreadAttr_t annc_thread_attr = { .name = "annc", .stack_size = 1536 };
+    m_thread_id = osThreadNew(announcement_loop, NULL, &annc_thread_attr);
+    if (NULL == m_thread_id)
+    {
+    	osSemaphoreDelete(m_sent_sem);
+    	m_sent_sem = NULL;
+    	osMutexDelete(m_orphan_mutex);
+    	m_orphan_mutex = NULL;
+    	osMutexDelete(m_mutex);
+    	m_mutex = NULL;
+    	return false;
+    }
+    return true;
+}
+
+
+bool deva_add_announcer (device_announcer_t * p_anc,
+	comms_layer_t * p_comms, comms_sleep_controller_t * p_rctrl,
+	uint32_t period_s)
+{
+	p_anc->comms = p_comms;
+	p_anc->comms_ctrl = p_rctrl;
+	p_anc->period = period_s;
+	p_anc->announcements = 0;
+	p_anc->next = NULL;
+	p_anc->next_deadline = NULL;
+	p_anc->trickle_imin = 0;
+	p_anc->listen_ms = DEVA_LISTEN_WINDOW_MS;
+	p_anc->followed = true; // Nothing sent yet
+	p_anc->sent = 0;
+	p_anc->reserved = NULL;
+	p_anc->reserved_busy = false;
+	p_anc->msg = NULL;
+	p_anc->msg_sending = false;
+	p_anc->msg_starting = false;
+	p_anc->msg_retry = false;
+	p_anc->msg_done = false;
+	p_anc->awake = false;
+	p_anc->wake_group = 0;
+	p_anc->deferred_count = 0;
+	atomic_init(&(p_anc->requests_head), 0);
+	atomic_init(&(p_anc->requests_tail), 0);
+	atomic_init(&(p_anc->heard_head), 0);
+	atomic_init(&(p_anc->heard_tail), 0);
+	memset(&(p_anc->stats), 0, sizeof(p_anc->stats));
+	atomic_init(&(p_anc->rcv_rate_limited), 0);
+	atomic_init(&(p_anc->rcv_queue_overflows), 0);
+	for (uint8_t i = 0; i < DEVA_RATE_SOURCES; i++)
+	{
+		p_anc->source_buckets[i].address = AM_BROADCAST_ADDR; // Never a source
+		p_anc->source_buckets[i].tokens = DEVA_RATE_SOURCE_BURST;
+		p_anc->source_buckets[i].updated = osCounterGetMilli();
+	}
+	p_anc->total_bucket.tokens = DEVA_RATE_TOTAL_BURST;
+	p_anc->total_bucket.updated = osCounterGetMilli();
+
+	if (COMMS_SUCCESS != comms_register_recv(p_comms, &(p_anc->rcvr),
+		radio_receive, p_anc, AMID_DEVICE_ANNOUNCEMENT))
+	{
+		err1("regr");
+		return false;
+	}
+
+#if DEVA_RESERVED_MESSAGES
+	p_anc->reserved = comms_pool_get(mp_pool, 0);
+	if (NULL == p_anc->reserved)
+	{
+		warn1("rsrv"); // Works, but without a guaranteed message
+	}
+#endif//DEVA_RESERVED_MESSAGES
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	// A controller shared by several announcers is registered only once, it
+	// belongs to one layer
+	p_anc->ctrl_owner = false;
+	if (NULL != p_rctrl)
+	{
+		device_announcer_t * p_sharer = find_ctrl_sharer(p_anc);
+		if (NULL == p_sharer)
+		{
+			if (COMMS_SUCCESS == comms_register_sleep_controller(p_comms, p_rctrl, radio_status_changed, p_anc))
+			{
+				p_anc->ctrl_owner = true;
+			}
+			else
+			{
+				err1("rctrl");
+			}
+		}
+		else if (p_sharer->comms != p_comms)
+		{
+			osMutexRelease(m_mutex);
+			err1("rctrl %p", p_sharer->comms);
+			if (NULL != p_anc->reserved)
+			{
+				comms_pool_put(mp_pool, p_anc->reserved);
+				p_anc->reserved = NULL;
+			}
+			comms_deregister_recv(p_comms, &(p_anc->rcvr));
+			return false;
+		}
+	}
+
+	device_announcer_t** pp_announcers = &mp_announcers;
+	while (NULL != *pp_announcers)
+	{
+		pp_announcers = &((*pp_announcers)->next);
+	}
+	*pp_announcers = p_anc;
+
+	// Limit period to "reasonable" values to not break calculations
+	if ((period_s >= DEVA_MIN_PERIOD_S) && (period_s <= DEVA_MAX_PERIOD_S))
+	{
+		uint32_t now = osCounterGetMilli();
+		uint32_t first = next_announcement(0, p_anc->period) * 1000UL;
+		p_anc->deadline = now + first - (rand() % first); // Spread out first announcements
+		align_deadline(p_anc);
+		schedule_insert(p_anc, now);
+		debug1("annc %p nxt %"PRIu32, p_anc, p_anc->deadline - now);
+	}
+	else
+	{
+		debug1("annc %p nvr", p_anc);
+	}
+
+	osMutexRelease(m_mutex);
+
+	osThreadFlagsSet(m_thread_id, ANNC_FLAG_NEW);
+
+	return true;
+}
+
+
+bool deva_set_trickle (device_announcer_t * p_anc, uint16_t imin_s, uint16_t imax_s, uint8_t k)
+{
+	bool found = false;
+
+	if ((0 != imin_s) && ((imax_s < imin_s) || (0 == k)))
+	{
+		warn1("trckl %u %u %u", imin_s, imax_s, k);
+		return false;
+	}
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	if (p_anc == find_announcer(p_anc))
+	{
+		uint32_t now = osCounterGetMilli();
+		found = true;
+
+		schedule_remove(p_anc);
+
+		p_anc->trickle_imin = imin_s;
+		p_anc->trickle_imax = imax_s;
+		p_anc->trickle_k = k;
+
+		if (0 != imin_s)
+		{
+			p_anc->trickle_interval = imin_s;
+			trickle_start_interval(p_anc, now);
+		}
+		else if ((p_anc->period >= DEVA_MIN_PERIOD_S) && (p_anc->period <= DEVA_MAX_PERIOD_S))
+		{
+			p_anc->deadline = now;
+			schedule_next(p_anc, now);
+		}
+	}
+
+	osMutexRelease(m_mutex);
+
+	if (found)
+	{
+		osThreadFlagsSet(m_thread_id, ANNC_FLAG_NEW);
+	}
+
+	return found;
+}
+
+
+bool deva_set_wake_group (device_announcer_t * p_anc, uint8_t group)
+{
+	bool found = false;
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	if (p_anc == find_announcer(p_anc))
+	{
+		found = true;
+		p_anc->wake_group = group;
+
+		// Trickle intervals are not aligned, neither are announcers that never announce
+		if ((0 == p_anc->trickle_imin)
+		  &&(p_anc->period >= DEVA_MIN_PERIOD_S) && (p_anc->period <= DEVA_MAX_PERIOD_S))
+		{
+			schedule_remove(p_anc);
+			align_deadline(p_anc);
+			schedule_insert(p_anc, osCounterGetMilli());
+		}
+	}
+
+	osMutexRelease(m_mutex);
+
+	if (found)
+	{
+		osThreadFlagsSet(m_thread_id, ANNC_FLAG_NEW);
+	}
+
+	return found;
+}
+
+
+bool deva_remove_announcer (device_announcer_t * p_anc)
+{
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	device_announcer_t** pp_announcers = &mp_announcers;
+	while (NULL != *pp_announcers)
+	{
+		if (p_anc == *pp_announcers)
+		{
+			*pp_announcers = (*pp_announcers)->next;
+			schedule_remove(p_anc);
+
+			// A reserved message that is in use is returned to the pool with msg
+			if ((NULL != p_anc->reserved) && ( ! p_anc->reserved_busy))
+			{
+				comms_pool_put(mp_pool, p_anc->reserved);
+			}
+			p_anc->reserved = NULL;
+
+			if ((NULL != p_anc->msg) && ( ! p_anc->msg_sending))
+			{
+				put_message(p_anc->msg); // Not in the list any more, goes to pool
+				p_anc->msg = NULL;
+			}
+
+			// The block of a sharer that is not the owner is released here
+			if ((p_anc->awake) && ( ! p_anc->ctrl_owner) && ( ! ctrl_awake(p_anc->comms_ctrl)))
+			{
+				comms_sleep_allow(p_anc->comms_ctrl);
+			}
+			p_anc->awake = false;
+
+			osMutexRelease(m_mutex); // Removed, rest of teardown is independent
+
+			if (NULL != p_anc->msg) // Comms still has it, wait for send-done
+			{
+				wait_send_done(p_anc);
+			}
+
+			if ((NULL != p_anc->comms_ctrl) && (p_anc->ctrl_owner))
+			{
+				// Another announcer on the same layer takes over the controller,
+				// under the mutex so the thread never finds it unregistered
+				while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+				if (COMMS_SUCCESS != comms_deregister_sleep_controller(p_anc->comms, p_anc->comms_ctrl))
+				{
+					sys_panic("drc");
+				}
+
+				device_announcer_t * p_sharer = find_ctrl_sharer(p_anc);
+				if (NULL != p_sharer)
 				{
-					anc->latitude = 0;
-					anc->longitude = 0;
-					anc->elevation = 0;
+					if (COMMS_SUCCESS == comms_register_sleep_controller(p_sharer->comms, p_sharer->comms_ctrl,
+					                                                     radio_status_changed, p_sharer))
+					{
+						p_sharer->ctrl_owner = true;
+						if (ctrl_awake(p_sharer->comms_ctrl))
+						{
+							comms_sleep_block(p_sharer->comms_ctrl); // Registration did not keep the block
+						}
+					}
+					else
+					{
+						err1("rctrl");
+					}
 				}
 
-				anc->ident_timestamp = hton64(IDENT_TIMESTAMP);
+				osMutexRelease(m_mutex);
+			}
+
+			if (COMMS_SUCCESS != comms_deregister_recv(p_anc->comms, &(p_anc->rcvr)))
+			{
+				sys_panic("drr");
+			}
+
+			return true;
+		}
+		pp_announcers = &((*pp_announcers)->next);
+	}
+
+	osMutexRelease(m_mutex);
+	return false;
+}
+
+
+bool deva_add_listener (device_announcement_listener_t * p_lst, deva_listener_f * callback, void * user)
+{
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	device_announcement_listener_t ** pp_listeners = &mp_listeners;
+	while (NULL != *pp_listeners)
+	{
+		if (p_lst == *pp_listeners)
+		{
+			osMutexRelease(m_mutex);
+			err1("dup %p", p_lst);
+			return false;
+		}
+		pp_listeners = &((*pp_listeners)->next);
+	}
+
+	p_lst->callback = callback;
+	p_lst->user = user;
+	p_lst->next = NULL;
+	*pp_listeners = p_lst;
+
+	osMutexRelease(m_mutex);
+	return true;
+}
+
+
+bool deva_remove_listener (device_announcement_listener_t * p_lst)
+{
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	device_announcement_listener_t ** pp_listeners = &mp_listeners;
+	while (NULL != *pp_listeners)
+	{
+		if (p_lst == *pp_listeners)
+		{
+			*pp_listeners = p_lst->next;
+			osMutexRelease(m_mutex);
+			return true;
+		}
+		pp_listeners = &((*pp_listeners)->next);
+	}
+
+	osMutexRelease(m_mutex);
+	return false;
+}
+
+
+static void notify_listeners (const device_announcement_t * p_da, am_addr_t source)
+{
+	device_announcement_listener_t * p_lst = mp_listeners;
+	while (NULL != p_lst)
+	{
+		p_lst->callback(p_da, source, p_lst->user);
+		p_lst = p_lst->next;
+	}
+}
+
+
+/**
+ * Serialize the parts of announcements and descriptions that do not change
+ * between sends. Coordinates are not cached, they can change without anyone
+ * calling deva_content_changed. Only called from the announcement thread.
+ **/
+static void build_templates (void)
+{
+	semver_t hwv = sigGetPlatformVersion();
+
+	m_templates_version = atomic_load(&m_content_version);
+
+	// Announcement v1
+	m_announcement_v1.header = DEVA_ANNOUNCEMENT;
+	m_announcement_v1.version = DEVICE_ANNOUNCEMENT_VERSION;
+	sigGetEui64((uint8_t*)m_announcement_v1.guid);
+	m_announcement_v1.boot_number = hton32(node_lifetime_boots());
+
+	m_announcement_v1.boot_time = hton64(m_boot_time);
+	m_announcement_v1.uptime = 0;       // Set on send
+	m_announcement_v1.lifetime = 0;     // Set on send
+	m_announcement_v1.announcement = 0; // Set on send
+
+	nx_uuid_application(&(m_announcement_v1.uuid));
+
+	m_announcement_v1.latitude = 0;  // Set on send
+	m_announcement_v1.longitude = 0; // Set on send
+	m_announcement_v1.elevation = 0; // Set on send
+
+	m_announcement_v1.ident_timestamp = hton64(IDENT_TIMESTAMP);
+	m_announcement_v1.feature_list_hash = 0; // Set on send
+
+	// Announcement v2
+	m_announcement_v2.header = DEVA_ANNOUNCEMENT;
+	m_announcement_v2.version = DEVICE_ANNOUNCEMENT_VERSION;
+	memcpy(m_announcement_v2.guid, m_announcement_v1.guid, sizeof(m_announcement_v2.guid));
+	m_announcement_v2.boot_number = m_announcement_v1.boot_number;
+
+	m_announcement_v2.boot_time = m_announcement_v1.boot_time;
+	m_announcement_v2.uptime = 0;       // Set on send
+	m_announcement_v2.lifetime = 0;     // Set on send
+	m_announcement_v2.announcement = 0; // Set on send
+
+	m_announcement_v2.uuid = m_announcement_v1.uuid;
+
+	m_announcement_v2.position_type = 'U'; // Set on send
+	m_announcement_v2.latitude = 0;        // Set on send
+	m_announcement_v2.longitude = 0;       // Set on send
+	m_announcement_v2.elevation = 0;       // Set on send
+
+	m_announcement_v2.radio_tech = 1; // Always 802.15.4 ... for now
+	m_announcement_v2.radio_channel = 0; // Set on send
+
+	m_announcement_v2.ident_timestamp = m_announcement_v1.ident_timestamp;
+	m_announcement_v2.feature_list_hash = 0; // Set on send
+
+	// Description v1
+	m_description_v1.header = DEVA_DESCRIPTION;
+	m_description_v1.version = DEVICE_ANNOUNCEMENT_VERSION;
+	memcpy(m_description_v1.guid, m_announcement_v1.guid, sizeof(m_description_v1.guid));
+	m_description_v1.boot_number = m_announcement_v1.boot_number;
+
+	sigGetPlatformUUID((uint8_t*)&(m_description_v1.platform));
+
+	sigGetBoardManufacturerUUID((uint8_t*)&(m_description_v1.manufacturer));
+	m_description_v1.production = hton64(sigGetPlatformProductionTime());
+
+	m_description_v1.ident_timestamp = m_announcement_v1.ident_timestamp;
+	m_description_v1.sw_major_version = SW_MAJOR_VERSION;
+	m_description_v1.sw_minor_version = SW_MINOR_VERSION;
+	m_description_v1.sw_patch_version = SW_PATCH_VERSION;
+
+	// Description v2
+	m_description_v2.header = DEVA_DESCRIPTION;
+	m_description_v2.version = DEVICE_ANNOUNCEMENT_VERSION;
+	memcpy(m_description_v2.guid, m_announcement_v1.guid, sizeof(m_description_v2.guid));
+	m_description_v2.boot_number = m_announcement_v1.boot_number;
+
+	m_description_v2.platform = m_description_v1.platform;
+
+	m_description_v2.hw_major_version = hwv.major;
+	m_description_v2.hw_minor_version = hwv.minor;
+	m_description_v2.hw_assem_version = hwv.patch;
+
+	m_description_v2.manufacturer = m_description_v1.manufacturer;
+	m_description_v2.production = m_description_v1.production;
+
+	m_description_v2.ident_timestamp = m_announcement_v1.ident_timestamp;
+	m_description_v2.sw_major_version = SW_MAJOR_VERSION;
+	m_description_v2.sw_minor_version = SW_MINOR_VERSION;
+	m_description_v2.sw_patch_version = SW_PATCH_VERSION;
+
+	debug1("tmpl %"PRIu32, m_templates_version);
+}
+
+
+static void update_templates (void)
+{
+	if (m_templates_version != atomic_load(&m_content_version))
+	{
+		build_templates();
+	}
+}
+
+
+/**
+ * Copy the counters of an announcer, adding the ones that the receive context
+ * keeps separately, so that no counter has two writers.
+ **/
+static void get_stats (device_announcer_t * p_anc, deva_stats_t * p_stats)
+{
+	*p_stats = p_anc->stats;
+	p_stats->rate_limited += atomic_load_explicit(&(p_anc->rcv_rate_limited), memory_order_relaxed);
+	p_stats->queue_overflows += atomic_load_explicit(&(p_anc->rcv_queue_overflows), memory_order_relaxed);
+}
+
+
+bool deva_get_stats (device_announcer_t * p_anc, deva_stats_t * p_stats)
+{
+	bool found = false;
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	if (NULL != find_announcer(p_anc))
+	{
+		get_stats(p_anc, p_stats);
+		found = true;
+	}
+
+	osMutexRelease(m_mutex);
+
+	return found;
+}
+
+
+uint32_t deva_dropped_requests (void)
+{
+	return atomic_load_explicit(&m_requests_dropped, memory_order_relaxed);
+}
+
+
+void deva_content_changed (void)
+{
+	atomic_fetch_add(&m_content_version, 1);
+}
+
+
+static comms_msg_t * announce (device_announcer_t * an, uint8_t version, am_addr_t destination)
+{
+	comms_msg_t * msg = get_message(an);
+	if (NULL != msg)
+	{
+		uint8_t length = 0;
+		coordinates_geo_t geo;
+		if ( ! node_coordinates_get(&geo))
+		{
+			geo.type = 'U';
+			geo.latitude = 0;
+			geo.longitude = 0;
+			geo.elevation = 0;
+		}
+
+		comms_init_message(an->comms, msg);
+		update_templates();
+		if (1 == version)
+		{
+			device_announcement_v1_t * anc = (device_announcement_v1_t*)comms_get_payload(an->comms, msg, sizeof(device_announcement_v1_t));
+			if (NULL != anc)
+			{
+				memcpy(anc, &m_announcement_v1, sizeof(device_announcement_v1_t));
+
+				anc->uptime = hton32(osCounterGetSecond());
+				anc->lifetime = hton32(node_lifetime_seconds());
+				anc->announcement = hton32(an->announcements);
+
+				anc->latitude = hton32(geo.latitude);
+				anc->longitude = hton32(geo.longitude);
+				anc->elevation = hton32(geo.elevation);
+
 				anc->feature_list_hash = hton32(devf_hash());
 
 				length = sizeof(device_announcement_v1_t);
@@ -465,180 +2129,276 @@ static comms_msg_t * announce (device_announcer_t * an, uint8_t version, am_addr
 			device_announcement_v2_t * anc = (device_announcement_v2_t*)comms_get_payload(an->comms, msg, sizeof(device_announcement_v2_t));
 			if (NULL != anc)
 			{
-				coordinates_geo_t geo;
-
-				anc->header = DEVA_ANNOUNCEMENT;
-				anc->version = DEVICE_ANNOUNCEMENT_VERSION;
-				sigGetEui64((uint8_t*)anc->guid);
-				anc->boot_number = hton32(node_lifetime_boots());
+				memcpy(anc, &m_announcement_v2, sizeof(device_announcement_v2_t));
 
-				anc->boot_time = hton64(m_boot_time);
 				anc->uptime = hton32(osCounterGetSecond());
 				anc->lifetime = hton32(node_lifetime_seconds());
 				anc->announcement = hton32(an->announcements);
 
-				nx_uuid_application(&(anc->uuid));
-				if (node_coordinates_get(&geo))
-				{
-					anc->position_type = geo.type;
-					anc->latitude = hton32(geo.latitude);
-					anc->longitude = hton32(geo.longitude);
-					anc->elevation = hton32(geo.elevation);
-				}
-				else
-				{
-					anc->position_type = 'U';
-					anc->latitude = 0;
-					anc->longitude = 0;
-					anc->elevation = 0;
-				}
+				anc->position_type = geo.type;
+				anc->latitude = hton32(geo.latitude);
+				anc->longitude = hton32(geo.longitude);
+				anc->elevation = hton32(geo.elevation);
+
+				anc->radio_channel = radio_channel(); // FIXME
+
+				anc->feature_list_hash = hton32(devf_hash());
+
+				length = sizeof(device_announcement_v2_t);
+			}
+		}
+
+		if (length > 0)
+		{
+			comms_set_packet_type(an->comms, msg, AMID_DEVICE_ANNOUNCEMENT);
+			comms_am_set_destination(an->comms, msg, destination);
+			comms_set_payload_length(an->comms, msg, length);
+			return msg;
+		}
+		put_message(msg);
+	}
+	else warn1("pool");
+
+	return NULL;
+}
+
+static comms_msg_t * describe(device_announcer_t* an, uint8_t version, am_addr_t destination)
+{
+	comms_msg_t * msg = get_message(an);
+	if (NULL != msg)
+	{
+		uint8_t length = 0;
+		comms_init_message(an->comms, msg);
+		update_templates();
+		if (version == 1)
+		{
+			device_description_v1_t* anc = (device_description_v1_t*)comms_get_payload(an->comms, msg, sizeof(device_description_v1_t));
+			if (NULL != anc)
+			{
+				memcpy(anc, &m_description_v1, sizeof(device_description_v1_t));
+				length = sizeof(device_description_v1_t);
+			}
+		}
+		else
+		{
+			device_description_v2_t* anc = (device_description_v2_t*)comms_get_payload(an->comms, msg, sizeof(device_description_v2_t));
+			if (NULL != anc)
+			{
+				memcpy(anc, &m_description_v2, sizeof(device_description_v2_t));
+				length = sizeof(device_description_v2_t);
+			}
+		}
+
+		if (length > 0)
+		{
+			comms_set_packet_type(an->comms, msg, AMID_DEVICE_ANNOUNCEMENT);
+			comms_am_set_destination(an->comms, msg, destination);
+			comms_set_payload_length(an->comms, msg, length);
+			return msg;
+		}
+
+		put_message(msg);
+	}
+	else warn1("pool");
+
+	return NULL;
+}
+
+static comms_msg_t * list_features(device_announcer_t* an, am_addr_t destination, uint8_t offset)
+{
+	comms_msg_t * msg = get_message(an);
+	if (NULL != msg)
+	{
+		uint8_t space = (comms_get_payload_max_length(an->comms) - sizeof(device_features_t)) / sizeof(uuid_t);
+
+		comms_init_message(an->comms, msg);
+
+		device_features_t * anc = (device_features_t*)comms_get_payload(an->comms, msg, sizeof(device_features_t) + space*sizeof(uuid_t));
+		if (NULL != anc)
+		{
+			devf_info_t info;
+			uint8_t ftrs;
+
+			anc->header = DEVA_FEATURES;
+			anc->version = DEVICE_ANNOUNCEMENT_VERSION;
+			sigGetEui64((uint8_t*)anc->guid);
+			anc->boot_number = hton32(node_lifetime_boots());
 
-				anc->radio_tech = 1; // Always 802.15.4 ... for now
-				anc->radio_channel = radio_channel(); // FIXME
+			// Any page is copied straight from the snapshot
+			ftrs = devf_get_features(offset, anc->features, space, &info);
 
-				anc->ident_timestamp = hton64(IDENT_TIMESTAMP);
-				anc->feature_list_hash = hton32(devf_hash());
+			anc->total = info.count;
+			anc->offset = offset;
 
-				length = sizeof(device_announcement_v2_t);
-			}
-		}
+			debugb1("ftrs %u total %u", anc, sizeof(device_features_t)+ftrs*sizeof(nx_uuid_t), ftrs, anc->total);
 
-		if (length > 0)
-		{
 			comms_set_packet_type(an->comms, msg, AMID_DEVICE_ANNOUNCEMENT);
 			comms_am_set_destination(an->comms, msg, destination);
-			comms_set_payload_length(an->comms, msg, length);
+			comms_set_payload_length(an->comms, msg, sizeof(device_features_t) + ftrs*sizeof(uuid_t));
+
 			return msg;
 		}
-		comms_pool_put(mp_pool, msg);
+		else warn1("pl");
+
+		put_message(msg);
 	}
 	else warn1("pool");
 
 	return NULL;
 }
 
-static comms_msg_t * describe(device_announcer_t* an, uint8_t version, am_addr_t destination)
+
+static comms_msg_t * not_modified (device_announcer_t * an, uint8_t version, am_addr_t destination, uint8_t request)
 {
-	comms_msg_t * msg = comms_pool_get(mp_pool, 0);
+	comms_msg_t * msg = get_message(an);
 	if (NULL != msg)
 	{
-		uint8_t length = 0;
 		comms_init_message(an->comms, msg);
-		if (version == 1)
-		{
-			device_description_v1_t* anc = (device_description_v1_t*)comms_get_payload(an->comms, msg, sizeof(device_description_v1_t));
-			if (NULL != anc)
-			{
-				anc->header = DEVA_DESCRIPTION;
-				anc->version = DEVICE_ANNOUNCEMENT_VERSION;
-				sigGetEui64((uint8_t*)anc->guid);
-				anc->boot_number = hton32(node_lifetime_boots());
-
-				sigGetPlatformUUID((uint8_t*)&(anc->platform));
 
-				sigGetBoardManufacturerUUID((uint8_t*)&(anc->manufacturer));
-				anc->production = hton64(sigGetPlatformProductionTime());
+		device_not_modified_t * nm = (device_not_modified_t*)comms_get_payload(an->comms, msg, sizeof(device_not_modified_t));
+		if (NULL != nm)
+		{
+			nm->header = DEVA_NOT_MODIFIED;
+			nm->version = version;
+			sigGetEui64((uint8_t*)nm->guid);
+			nm->boot_number = hton32(node_lifetime_boots());
+			nm->request = request;
 
-				anc->ident_timestamp = hton64(IDENT_TIMESTAMP);
-				anc->sw_major_version = SW_MAJOR_VERSION;
-				anc->sw_minor_version = SW_MINOR_VERSION;
-				anc->sw_patch_version = SW_PATCH_VERSION;
+			comms_set_packet_type(an->comms, msg, AMID_DEVICE_ANNOUNCEMENT);
+			comms_am_set_destination(an->comms, msg, destination);
+			comms_set_payload_length(an->comms, msg, sizeof(device_not_modified_t));
 
-				length = sizeof(device_description_v1_t);
-			}
+			return msg;
 		}
-		else
-		{
-			device_description_v2_t* anc = (device_description_v2_t*)comms_get_payload(an->comms, msg, sizeof(device_description_v2_t));
-			if (NULL != anc)
-			{
-				semver_t hwv = sigGetPlatformVersion();
+		else warn1("pl");
 
-				anc->header = DEVA_DESCRIPTION;
-				anc->version = DEVICE_ANNOUNCEMENT_VERSION;
-				sigGetEui64((uint8_t*)anc->guid);
-				anc->boot_number = hton32(node_lifetime_boots());
+		put_message(msg);
+	}
+	else warn1("pool");
 
-				sigGetPlatformUUID((uint8_t*)&(anc->platform));
+	return NULL;
+}
 
-				anc->hw_major_version = hwv.major;
-				anc->hw_minor_version = hwv.minor;
-				anc->hw_assem_version = hwv.patch;
+static comms_msg_t * feature_filter (device_announcer_t * an, am_addr_t destination)
+{
+	comms_msg_t * msg = get_message(an);
+	if (NULL != msg)
+	{
+		comms_init_message(an->comms, msg);
 
-				sigGetBoardManufacturerUUID((uint8_t*)&(anc->manufacturer));
-				anc->production = hton64(sigGetPlatformProductionTime());
+		device_feature_filter_t * ff = (device_feature_filter_t*)comms_get_payload(an->comms, msg, sizeof(device_feature_filter_t) + DEVF_FILTER_BYTES);
+		if (NULL != ff)
+		{
+			devf_info_t info;
 
-				anc->ident_timestamp = hton64(IDENT_TIMESTAMP);
-				anc->sw_major_version = SW_MAJOR_VERSION;
-				anc->sw_minor_version = SW_MINOR_VERSION;
-				anc->sw_patch_version = SW_PATCH_VERSION;
+			ff->header = DEVA_FEATURE_FILTER;
+			ff->version = DEVICE_ANNOUNCEMENT_VERSION;
+			sigGetEui64((uint8_t*)ff->guid);
+			ff->boot_number = hton32(node_lifetime_boots());
 
-				length = sizeof(device_description_v2_t);
-			}
-		}
+			devf_get_filter((uint8_t*)ff->filter, &info);
+
+			ff->feature_list_hash = hton32(info.hash);
+			ff->count = info.count;
 
-		if (length > 0)
-		{
 			comms_set_packet_type(an->comms, msg, AMID_DEVICE_ANNOUNCEMENT);
 			comms_am_set_destination(an->comms, msg, destination);
-			comms_set_payload_length(an->comms, msg, length);
+			comms_set_payload_length(an->comms, msg, sizeof(device_feature_filter_t) + DEVF_FILTER_BYTES);
+
 			return msg;
 		}
+		else warn1("pl");
 
-		comms_pool_put(mp_pool, msg);
+		put_message(msg);
 	}
 	else warn1("pool");
 
 	return NULL;
 }
 
-static comms_msg_t * list_features(device_announcer_t* an, am_addr_t destination, uint8_t offset)
+/**
+ * Estimate a latency percentile from the histogram, the upper limit of the
+ * bucket where the percentile falls is reported.
+ **/
+static uint16_t latency_percentile (const deva_stats_t * p_stats, uint8_t percent)
 {
-	comms_msg_t * msg = comms_pool_get(mp_pool, 0);
-	if (NULL != msg)
+	uint32_t total = 0;
+	uint32_t count = 0;
+	uint32_t target;
+
+	for (uint8_t i = 0; i < DEVA_STATS_LATENCY_BUCKETS; i++)
 	{
-		uint8_t space = (comms_get_payload_max_length(an->comms) - sizeof(device_features_t)) / sizeof(uuid_t);
+		total += p_stats->latency[i];
+	}
+	if (0 == total)
+	{
+		return 0;
+	}
 
+	target = (total * percent + 99) / 100;
+	for (uint8_t i = 0; i < DEVA_STATS_LATENCY_BUCKETS - 1; i++)
+	{
+		count += p_stats->latency[i];
+		if (count >= target)
+		{
+			return m_latency_limits_ms[i];
+		}
+	}
+	return UINT16_MAX;
+}
+
+static comms_msg_t * statistics(device_announcer_t* an, am_addr_t destination)
+{
+	comms_msg_t * msg = get_message(an);
+	if (NULL != msg)
+	{
 		comms_init_message(an->comms, msg);
 
-		device_features_t * anc = (device_features_t*)comms_get_payload(an->comms, msg, sizeof(device_features_t) + space*sizeof(uuid_t));
-		if (NULL != anc)
+		device_statistics_t * st = (device_statistics_t*)comms_get_payload(an->comms, msg, sizeof(device_statistics_t));
+		if (NULL != st)
 		{
-			uint8_t total_features = devf_count();
-			uint8_t ftrs = 0;
-			uint8_t skip = 0;
+			deva_stats_t stats;
+			const deva_stats_t * p_stats = &stats;
+			uint32_t stack = osThreadGetStackSpace(m_thread_id);
 
-			anc->header = DEVA_FEATURES;
-			anc->version = DEVICE_ANNOUNCEMENT_VERSION;
-			sigGetEui64((uint8_t*)anc->guid);
-			anc->boot_number = hton32(node_lifetime_boots());
+			get_stats(an, &stats);
 
-			anc->total = total_features;
-			anc->offset = offset;
+			st->header = DEVA_STATISTICS;
+			st->version = DEVICE_ANNOUNCEMENT_VERSION;
+			sigGetEui64((uint8_t*)st->guid);
+			st->boot_number = hton32(node_lifetime_boots());
 
-			for (;(ftrs<space)&&(offset+skip+ftrs<total_features);)
-			{
-				if (devf_get_feature(offset+ftrs, &(anc->features[ftrs])))
-				{
-					ftrs++;
-				}
-				else // Feature disabled ... or problematic?
-				{
-					skip++;
-				}
-			}
+			st->stats_version = DEVICE_STATISTICS_VERSION;
+			st->uptime = hton32(osCounterGetSecond());
 
-			debugb1("ftrs %u total %u", anc, sizeof(device_features_t)+ftrs*sizeof(nx_uuid_t), ftrs, anc->total);
+			st->announcements = hton32(p_stats->announcements);
+			st->responses = hton32(p_stats->queries + p_stats->describes + p_stats->feature_lists
+			                       + p_stats->diagnostics + p_stats->not_modified);
+			st->suppressed = hton32(p_stats->suppressed);
+			st->rate_limited = hton32(p_stats->rate_limited);
+			st->queue_overflows = hton32(p_stats->queue_overflows);
+			st->pool_empty = hton32(p_stats->pool_empty);
+			st->send_failures = hton32(p_stats->send_failures);
+			st->retries = hton32(p_stats->retries);
+			st->stale = hton32(p_stats->stale);
+
+			st->latency_p50 = hton16(latency_percentile(p_stats, 50));
+			st->latency_p90 = hton16(latency_percentile(p_stats, 90));
+			st->latency_p99 = hton16(latency_percentile(p_stats, 99));
+
+			st->stack_free = hton16(stack > UINT16_MAX ? UINT16_MAX : stack);
+
+			debugb1("stats", st, sizeof(device_statistics_t));
 
 			comms_set_packet_type(an->comms, msg, AMID_DEVICE_ANNOUNCEMENT);
 			comms_am_set_destination(an->comms, msg, destination);
-			comms_set_payload_length(an->comms, msg, sizeof(device_features_t) + ftrs*sizeof(uuid_t));
+			comms_set_payload_length(an->comms, msg, sizeof(device_statistics_t));
 
 			return msg;
 		}
 		else warn1("pl");
 
-		comms_pool_put(mp_pool, msg);
+		put_message(msg);
 	}
 	else warn1("pool");
 
@@ -648,25 +2408,238 @@ static comms_msg_t * list_features(device_announcer_t* an, am_addr_t destination
 
 static void radio_status_changed (comms_layer_t * comms, comms_status_t status, void * user)
 {
-    // Actual status change is checked by polling, but the callback is mandatory
+	if (COMMS_STARTED == status)
+	{
+		debug1("%p strtd", user);
+		osThreadFlagsSet(m_thread_id, ANNC_FLAG_STR);
+	}
 }
 
 
 static void radio_send_done (comms_layer_t * comms, comms_msg_t * msg, comms_error_t result, void * user)
 {
-	logger(result == COMMS_SUCCESS ? LOG_DEBUG1: LOG_WARN1, "snt(%d)", (int)result);
+	device_announcer_t * p_anc = (device_announcer_t*)user;
+	bool orphan = false;
+
+	logger(result == COMMS_SUCCESS ? LOG_DEBUG1: LOG_WARN1, "%p snt(%d)", p_anc, (int)result);
+
+	while (osOK != osMutexAcquire(m_orphan_mutex, osWaitForever));
+	for (uint8_t i = 0; i < DEVA_ORPHANED_MESSAGES; i++)
+	{
+		if (msg == m_orphans[i])
+		{
+			m_orphans[i] = NULL;
+			orphan = true;
+			break;
+		}
+	}
+	if ( ! orphan)
+	{
+		p_anc->msg_result = result;
+		p_anc->msg_done_at = osCounterGetMilli();
+		p_anc->msg_done = true;
+	}
+	osMutexRelease(m_orphan_mutex);
+
+	if (orphan) // The announcer has been removed, p_anc must not be touched
+	{
+		warn1("orph %p", msg);
+		comms_pool_put(mp_pool, msg);
+		return;
+	}
+
+	osSemaphoreRelease(m_sent_sem); // In case the announcer is being removed
 	osThreadFlagsSet(m_thread_id, ANNC_FLAG_SNT);
 }
 
 
 /**
- * Parse incoming messaages. When the message contains a request, pass on only
- * the request through the request fields of announcement_action_t. If it contains
- * info about another node, copy the entire message and pass that to the
- * announcement thread.
+ * Hand the message of the announcer over to radio_send_done, which returns it
+ * to the pool whenever the layer is done with it. Fails if send-done has
+ * already come or all DEVA_ORPHANED_MESSAGES slots are taken.
+ **/
+static bool orphan_message (device_announcer_t * p_anc)
+{
+	bool orphaned = false;
+
+	while (osOK != osMutexAcquire(m_orphan_mutex, osWaitForever));
+	if ( ! p_anc->msg_done)
+	{
+		for (uint8_t i = 0; i < DEVA_ORPHANED_MESSAGES; i++)
+		{
+			if (NULL == m_orphans[i])
+			{
+				m_orphans[i] = p_anc->msg;
+				orphaned = true;
+				break;
+			}
+		}
+	}
+	osMutexRelease(m_orphan_mutex);
+
+	return orphaned;
+}
+
+
+/**
+ * Wait for send-done of a removed announcer, for up to DEVA_REMOVE_TIMEOUT_MS.
+ * When the layer does not finish in time, the message is handed over to
+ * radio_send_done, which returns it to the pool. The wait is only unbounded if
+ * all DEVA_ORPHANED_MESSAGES slots are taken by layers that are stuck as well.
+ **/
+static void wait_send_done (device_announcer_t * p_anc)
+{
+	uint32_t start = osCounterGetMilli();
+
+	for (;;)
+	{
+		uint32_t elapsed = osCounterGetMilli() - start;
+
+		if ((elapsed >= DEVA_REMOVE_TIMEOUT_MS) && (orphan_message(p_anc)))
+		{
+			warn1("orph %p", p_anc->msg);
+			break;
+		}
+		if (p_anc->msg_done) // Set under m_orphan_mutex, before m_sent_sem is released
+		{
+			comms_pool_put(mp_pool, p_anc->msg);
+			break;
+		}
+
+		if (elapsed >= DEVA_REMOVE_TIMEOUT_MS)
+		{
+			err1("orph full"); // Nothing else to do but wait
+			osSemaphoreAcquire(m_sent_sem, DEVA_REMOVE_TIMEOUT_MS);
+		}
+		else
+		{
+			// Released by any send-done, so check again when it returns
+			osSemaphoreAcquire(m_sent_sem, DEVA_REMOVE_TIMEOUT_MS - elapsed);
+		}
+	}
+	p_anc->msg = NULL;
+}
+
+
+/**
+ * Pass a request to the announcement thread, the thread is only notified when
+ * the ring was empty, otherwise it is still working on it. A request that is
+ * already pending is coalesced with it, so a flood of the same request takes
+ * up a single entry.
+ **/
+static void submit_request (device_announcer_t * p_anc, const device_announcement_request_t * p_req)
+{
+	bool was_empty = false;
+
+	if ( ! request_allowed(p_anc, p_req->address))
+	{
+		debug1("%04"PRIX16" lim", p_req->address);
+		atomic_fetch_add_explicit(&(p_anc->rcv_rate_limited), 1, memory_order_relaxed);
+		return;
+	}
+
+	if (request_pending(p_anc, p_req))
+	{
+		debug1("%04"PRIX16" dup", p_req->address);
+		return;
+	}
+
+	if (push_request(p_anc, p_req, &was_empty))
+	{
+		if (was_empty)
+		{
+			osThreadFlagsSet(m_thread_id, ANNC_FLAG_RCV);
+		}
+		return;
+	}
+	warn1("qb"); // Ring has overflowed
+	atomic_fetch_add_explicit(&(p_anc->rcv_queue_overflows), 1, memory_order_relaxed);
+}
+
+
+/**
+ * Pass an announcement from another device to the announcement thread.
+ **/
+static void submit_heard (device_announcer_t * p_anc, const device_announcement_heard_t * p_dh)
+{
+	bool was_empty = false;
+	if (push_heard(p_anc, p_dh, &was_empty))
+	{
+		if (was_empty)
+		{
+			osThreadFlagsSet(m_thread_id, ANNC_FLAG_RCV);
+		}
+		return;
+	}
+	warn1("qa"); // Ring has overflowed
+	atomic_fetch_add_explicit(&(p_anc->rcv_queue_overflows), 1, memory_order_relaxed);
+}
+
+
+/**
+ * Validate a received announcement and store it in the current version structure.
+ **/
+static bool parse_announcement (const uint8_t * payload, uint8_t len, device_announcement_t * p_da)
+{
+	uint8_t version = payload[1];
+
+	if (version == DEVICE_ANNOUNCEMENT_VERSION)
+	{ // version 2
+		if (len >= sizeof(device_announcement_v2_t))
+		{
+			memcpy(p_da, payload, sizeof(device_announcement_v2_t));
+			return true;
+		}
+	}
+	else if (version == 1)
+	{ // version 1 - upgrade to current version structure (2 currently)
+		if (len >= sizeof(device_announcement_v1_t))
+		{
+			const device_announcement_v1_t* da1 = (const device_announcement_v1_t*)payload;
+
+			p_da->header = da1->header;
+			p_da->version = DEVICE_ANNOUNCEMENT_VERSION;
+			memcpy(p_da->guid, da1->guid, 8);
+			p_da->boot_number = da1->boot_number;
+
+			p_da->boot_time = da1->boot_time;
+			p_da->uptime = da1->uptime;
+			p_da->lifetime = da1->lifetime;
+			p_da->announcement = da1->announcement;
+
+			p_da->uuid = da1->uuid;
+
+			p_da->position_type = 'U'; // position type in V1 is not specified ... could be anything
+			p_da->latitude = da1->latitude;
+			p_da->longitude = da1->longitude;
+			p_da->elevation = da1->elevation;
+
+			p_da->radio_tech = 0; // 0:unknown(channel info invalid)
+			p_da->radio_channel = 0;
+
+			p_da->ident_timestamp = da1->ident_timestamp;
+
+			p_da->feature_list_hash = da1->feature_list_hash;
+			return true;
+		}
+	}
+	else
+	{
+		warn1("ver %u", (unsigned int)version); // Unknown version ... what to do?
+	}
+	return false;
+}
+
+
+/**
+ * Parse incoming messaages in the receive context. Requests are passed on
+ * in the compact device_announcement_request_t, announcements from other
+ * nodes are validated and passed on in device_announcement_heard_t, so no
+ * messages are held up while the announcement thread gets around to them.
  **/
 static void radio_receive (comms_layer_t * comms, const comms_msg_t * msg, void * user)
 {
+	device_announcer_t * p_anc = (device_announcer_t*)user;
 	uint8_t len = comms_get_payload_length(comms, msg);
 	uint8_t * payload = comms_get_payload(comms, msg, len);
 	am_addr_t source = comms_am_get_source(comms, msg);
@@ -674,69 +2647,85 @@ static void radio_receive (comms_layer_t * comms, const comms_msg_t * msg, void
 	debugb1("c %p rcv %04"PRIX16, payload, len, comms, source);
 	if (len >= 2)
 	{
-		announcement_action_t aa;
-		aa.p_anc = (device_announcer_t*)user;
-		aa.action = ((uint8_t*)payload)[0];
-		aa.p_msg = NULL;
-		switch (aa.action)
+		device_announcement_request_t req;
+		req.action = ((uint8_t*)payload)[0];
+		req.address = source;
+		req.version = ((uint8_t*)payload)[1];
+		req.offset = 0;
+		req.broadcast = (AM_BROADCAST_ADDR == comms_am_get_destination(comms, msg));
+		req.conditional = false;
+		req.ident_timestamp = 0;
+		req.feature_list_hash = 0;
+		req.received = osCounterGetMilli();
+		switch (req.action)
 		{
 			case DEVA_ANNOUNCEMENT:
-			case DEVA_DESCRIPTION:
-			case DEVA_FEATURES:
-				aa.p_msg = comms_pool_get(mp_pool, 0);
-				if (NULL != aa.p_msg)
+			{
+				device_announcement_heard_t dh;
+				dh.source = source;
+				if (parse_announcement(payload, len, &(dh.announcement)))
 				{
-					memcpy(aa.p_msg, msg, sizeof(comms_msg_t));
-					if (osOK != osMessageQueuePut(m_action_queue, &aa, 0, 0))
-					{
-						warn1("qb"); // Queue has overflowed
-						comms_pool_put(mp_pool, aa.p_msg);
-					}
-					else
-					{
-						osThreadFlagsSet(m_thread_id, ANNC_FLAG_RCV);
-					}
+					submit_heard(p_anc, &dh);
 				}
 				else
 				{
-					warn1("mb"); // No messages available for copy
+					warn1("%04"PRIX16" anc", source);
 				}
+			}
+			break;
+
+			case DEVA_DESCRIPTION:
+			case DEVA_FEATURES:
+			case DEVA_STATISTICS:
+			case DEVA_NOT_MODIFIED:
+			case DEVA_FEATURE_FILTER:
+				debug1("%04"PRIX16" %02X", source, (unsigned int)req.action); // Not used locally
 			break;
 
 			// All 3 requests handled similarly, but features has an extra argument
 			case DEVA_LIST_FEATURES:
 				if (len >= 3)
 				{
-					aa.request.offset = ((uint8_t*)payload)[2];
-					if (osOK != osMessageQueuePut(m_action_queue, &aa, 0, 0))
-					{
-						warn1("qb"); // Queue has overflowed
-						comms_pool_put(mp_pool, aa.p_msg);
-					}
-					else
+					req.offset = ((uint8_t*)payload)[2];
+					if (len >= sizeof(device_conditional_feature_request_t))
 					{
-						osThreadFlagsSet(m_thread_id, ANNC_FLAG_RCV);
+						const device_conditional_feature_request_t * p_cr = (const device_conditional_feature_request_t*)payload;
+						req.conditional = true;
+						req.ident_timestamp = ntoh64(p_cr->ident_timestamp);
+						req.feature_list_hash = ntoh32(p_cr->feature_list_hash);
 					}
+					submit_request(p_anc, &req);
 				}
 			break;
 
-			case DEVA_DESCRIBE:
-			case DEVA_QUERY:
-				aa.request.address = source;
-				aa.request.version = ((uint8_t*)payload)[1];
-
-				if (osOK != osMessageQueuePut(m_action_queue, &aa, 0, 0))
+			// Filtered queries are answered like queries, but only by matching devices,
+			// others drop them here without spending rate limit tokens
+			case DEVA_QUERY_FILTERED:
+				if ((len >= sizeof(device_filtered_request_t))
+				  &&(filter_matches((const device_filtered_request_t*)payload)))
 				{
-					warn1("qb"); // Queue has overflowed
+					req.action = DEVA_QUERY;
+					submit_request(p_anc, &req);
 				}
-				else
+			break;
+
+			case DEVA_GET_FEATURE_FILTER:
+			case DEVA_GET_STATISTICS:
+			case DEVA_DESCRIBE:
+			case DEVA_QUERY:
+				if (((DEVA_QUERY == req.action) || (DEVA_DESCRIBE == req.action))
+				  &&(len >= sizeof(device_conditional_request_t)))
 				{
-					osThreadFlagsSet(m_thread_id, ANNC_FLAG_RCV);
+					const device_conditional_request_t * p_cr = (const device_conditional_request_t*)payload;
+					req.conditional = true;
+					req.ident_timestamp = ntoh64(p_cr->ident_timestamp);
+					req.feature_list_hash = ntoh32(p_cr->feature_list_hash);
 				}
+				submit_request(p_anc, &req);
 			break;
 
 			default:
-				warnb1("dflt %d", payload, len, (int)aa.action);
+				warnb1("dflt %d", payload, len, (int)req.action);
 			break;
 		}
 	}
@@ -757,71 +2746,33 @@ static uint8_t adjust_version (uint8_t version)
 }
 
 
-static comms_msg_t * handle_action (const announcement_action_t * aa)
+/**
+ * Update neighbors, Trickle and local listeners with an announcement heard
+ * from another device.
+ **/
+static void handle_heard (device_announcer_t * p_anc, const device_announcement_heard_t * p_dh)
 {
-	switch (aa->action)
-	{
-		case DEVA_ANNOUNCEMENT:
-		{
-			uint8_t len = comms_get_payload_length(aa->p_anc->comms, aa->p_msg);
-			uint8_t * payload = comms_get_payload(aa->p_anc->comms, aa->p_msg, len);
-			am_addr_t source = comms_am_get_source(aa->p_anc->comms, aa->p_msg);
-			uint8_t version = ((uint8_t*)payload)[1];
-
-			if (version == DEVICE_ANNOUNCEMENT_VERSION)
-			{ // version 2
-				if (len >= sizeof(device_announcement_v2_t))
-				{
-					device_announcement_v2_t* da = (device_announcement_v2_t*)payload;
-					infob1("anc %"PRIu32":%"PRIu32, da->guid, 8,
-						(uint32_t)(da->boot_number), (uint32_t)(da->uptime));
-					(void)da;
-					//signal DeviceAnnouncement.received(call AMPacket.source[iface](msg), da); // TODO a proper event?
-				}
-			}
-			else if (version == 1)
-			{ // version 1 - upgrade to current version structure (2 currently)
-				if (len >= sizeof(device_announcement_v1_t))
-				{
-					device_announcement_v1_t* da1 = (device_announcement_v1_t*)payload;
-					device_announcement_v2_t da;
-
-					da.header = da1->header;
-					da.version = DEVICE_ANNOUNCEMENT_VERSION;
-					memcpy(da.guid, da1->guid, 8);
-					da.boot_number = da1->boot_number;
-
-					da.boot_time = da1->boot_time;
-					da.uptime = da1->uptime;
-					da.lifetime = da1->lifetime;
-					da.announcement = da1->announcement;
-
-					da.uuid = da1->uuid;
-
-					da.position_type = 'U'; // position type in V1 is not specified ... could be anything
-					da.latitude = da1->latitude;
-					da.longitude = da1->longitude;
-					da.elevation = da1->elevation;
-
-					da.radio_tech = 0; // 0:unknown(channel info invalid)
-					da.radio_channel = 0;
-
-					da.ident_timestamp = da1->ident_timestamp;
-
-					da.feature_list_hash = da1->feature_list_hash;
+	const device_announcement_t * da = &(p_dh->announcement);
+	uint8_t changes = devn_update(da, p_dh->source);
+	if (changes & DEVN_CHANGED_BOOT)
+	{ // A neighbor that is still in the table has restarted and not heard about us yet
+		trickle_reset(p_anc, osCounterGetMilli());
+	}
+	else if (p_anc->trickle_counter < UINT8_MAX)
+	{ // Counts towards suppressing our own announcements, a neighbor that is only
+	  // new to the table may just have been evicted, that is not an inconsistency
+		p_anc->trickle_counter++;
+	}
+	infob1("anc %"PRIu32":%"PRIu32" %02X", da->guid, 8,
+		ntoh32(da->boot_number), ntoh32(da->uptime), (unsigned int)changes);
+	notify_listeners(da, p_dh->source);
+}
 
-					infob1("anc %"PRIu32":%"PRIu32, da.guid, 8,
-						(uint32_t)(da.boot_number), (uint32_t)(da.uptime));
-					//signal DeviceAnnouncement.received(call AMPacket.source[iface](msg), &da); // TODO a proper event?
-				}
-			}
-			else
-			{
-				warn1("%04"PRIX16" ver %u", source, (unsigned int)((uint8_t*)payload)[1]); // Unknown version ... what to do?
-			}
-		}
-		break;
 
+static comms_msg_t * handle_action (const device_announcement_action_t * aa)
+{
+	switch (aa->request.action)
+	{
 		case DEVA_QUERY:
 			info1("qry v%d %04"PRIX16, (int)adjust_version(aa->request.version), aa->request.address);
 			return announce(aa->p_anc, adjust_version(aa->request.version), aa->request.address);
@@ -831,9 +2782,15 @@ static comms_msg_t * handle_action (const announcement_action_t * aa)
 		case DEVA_LIST_FEATURES:
 			info1("lst %04"PRIX16, aa->request.address);
 			return list_features(aa->p_anc, aa->request.address, aa->request.offset);
+		case DEVA_GET_STATISTICS:
+			info1("sts %04"PRIX16, aa->request.address);
+			return statistics(aa->p_anc, aa->request.address);
+		case DEVA_GET_FEATURE_FILTER:
+			info1("flt %04"PRIX16, aa->request.address);
+			return feature_filter(aa->p_anc, aa->request.address);
 
 		default:
-			warn1("dflt %d", (int)aa->action);
+			warn1("dflt %d", (int)aa->request.action);
 		break;
 	}
 
@@ -845,9 +2802,20 @@ static comms_msg_t * handle_action (const announcement_action_t * aa)
 
 #include "device_announcement_test.h"
 
-uint32_t unittest_process_announcements (uint32_t flags, uint32_t current_timeout_s)
+uint32_t unittest_process_announcements (uint32_t flags)
+{
+	return process_announcements(flags);
+}
+
+bool unittest_push_request (device_announcer_t * p_anc, const device_announcement_request_t * p_req)
+{
+	bool was_empty;
+	return push_request(p_anc, p_req, &was_empty);
+}
+
+bool unittest_pop_request (device_announcer_t * p_anc, device_announcement_request_t * p_req)
 {
-	return process_announcements(flags, current_timeout_s);
+	return pop_request(p_anc, p_req);
 }
 
 #endif//UNITTEST
@@ -1,68 +1,234 @@
 /**
  * Device feature storage in a linked-list with user-provided list elements.
  *
+ * The list is only walked by writers, which are serialized by a mutex. After
+ * every change the writer publishes a snapshot of the features, their hash and
+ * filter into one of two module-owned buffers. Readers copy from the current
+ * snapshot and never touch list elements, so an element can be reused as soon
+ * as it has been removed. Each snapshot has a sequence number that is odd
+ * while it is being written, a reader that loses a race with two consecutive
+ * writers retries with the newer snapshot, readers never wait.
+ *
  * Copyright Thinnect Inc. 2019
  * @author Raido Pahtma
  * @license MIT
  */
 
 #include "device_features.h"
+#include "DeviceFeatureListHash.h"
+#include "DeviceFeatureFilter.h"
+
+#include <stdatomic.h>
+
+#include "cmsis_os2.h"
 
 #include "loglevels.h"
 #define __MODUUL__ "DevF"
 #define __LOG_LEVEL__ ( LOG_LEVEL_device_features & BASE_LOG_LEVEL )
 #include "log.h"
 
-static device_feature_t * mp_features;
+typedef struct devf_snapshot
+{
+	atomic_uint_fast32_t sequence; // Odd while the snapshot is being written
+	uint32_t generation;
+	uint32_t hash;
+	uint8_t count;
+	uint8_t filter[DEVF_FILTER_BYTES];
+	nx_uuid_t features[DEVF_MAX_FEATURES];
+} devf_snapshot_t;
+
+static device_feature_t * mp_features; // Only accessed by writers
 static uint8_t m_count;
+static uint32_t m_generation;
+
+static devf_snapshot_t m_snapshots[2];
+static atomic_uint_fast8_t m_current; // Snapshot given to readers
+
+static osMutexId_t m_write_mutex;
+
+/**
+ * Copy the list into the snapshot that readers are not directed to and then
+ * direct them to it. Called with the write mutex held.
+ **/
+static void publish ()
+{
+	uint8_t next = 1 - atomic_load_explicit(&m_current, memory_order_relaxed);
+	devf_snapshot_t * ps = &m_snapshots[next];
+	uint32_t seq = atomic_load_explicit(&ps->sequence, memory_order_relaxed);
+	uint32_t hash_state = DEVICE_FEATURE_LIST_HASH_OFFSET;
+	uint8_t count = 0;
+
+	// A reader that fetched this snapshot before the previous swap sees an odd
+	// or changed sequence and retries
+	atomic_store_explicit(&ps->sequence, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memset(ps->filter, 0, sizeof(ps->filter)); // Bits can't be cleared one feature at a time
+	for (device_feature_t * pf = mp_features; NULL != pf; pf = pf->next)
+	{
+		memcpy(&(ps->features[count]), &(pf->uuid), sizeof(nx_uuid_t));
+		hash_state = feature_list_hash_add(hash_state, &(pf->uuid));
+		feature_filter_add(ps->filter, sizeof(ps->filter), &(pf->uuid));
+		count++;
+	}
+	ps->count = count;
+	ps->hash = (0 == count) ? DEVICE_FEATURE_LIST_HASH_EMPTY : hash_state;
+	ps->generation = ++m_generation;
+
+	atomic_store_explicit(&ps->sequence, seq + 2, memory_order_release);
+	atomic_store_explicit(&m_current, next, memory_order_release);
+}
+
+static const devf_snapshot_t * read_begin (uint32_t * pseq)
+{
+	for (;;)
+	{
+		const devf_snapshot_t * ps = &m_snapshots[atomic_load_explicit(&m_current, memory_order_acquire)];
+		uint32_t seq = atomic_load_explicit(&ps->sequence, memory_order_acquire);
+		if (0 == (seq & 1))
+		{
+			*pseq = seq;
+			return ps;
+		}
+		// Swapped and being rewritten already, m_current has moved on
+	}
+}
+
+static bool read_retry (const devf_snapshot_t * ps, uint32_t seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return seq != atomic_load_explicit(&ps->sequence, memory_order_relaxed);
+}
+
+static void read_info (const devf_snapshot_t * ps, devf_info_t * pinfo)
+{
+	pinfo->generation = ps->generation;
+	pinfo->count = ps->count;
+	pinfo->hash = ps->hash;
+}
 
 void devf_init ()
 {
+	const osMutexAttr_t devf_mutex_attr = { "devf", osMutexPrioInherit, NULL, 0U };
+	m_write_mutex = osMutexNew(&devf_mutex_attr);
+
 	mp_features = NULL;
 	m_count = 0;
+	publish(); // Empty list, in a new generation
+}
+
+void devf_get_info (devf_info_t * pinfo)
+{
+	const devf_snapshot_t * ps;
+	uint32_t seq;
+	do
+	{
+		ps = read_begin(&seq);
+		read_info(ps, pinfo);
+	} while (read_retry(ps, seq));
 }
 
 uint8_t devf_count ()
 {
-	return m_count;
+	devf_info_t info;
+	devf_get_info(&info);
+	return info.count;
 }
 
 uint32_t devf_hash ()
 {
-	uint32_t hash = 0;  // Really simple for now, just a sum of bytes
-	device_feature_t * pf = mp_features;
-	while (NULL != pf)
+	devf_info_t info;
+	devf_get_info(&info);
+	return info.hash;
+}
+
+uint8_t devf_get_features (uint8_t offset, nx_uuid_t ftrs[], uint8_t max, devf_info_t * pinfo)
+{
+	for (;;)
 	{
-		for (uint8_t i=0; i < sizeof(nx_uuid_t); i++)
+		uint32_t seq;
+		const devf_snapshot_t * ps = read_begin(&seq);
+		uint8_t copied = 0;
+
+		for (uint8_t index = offset; (index < ps->count) && (copied < max); index++)
 		{
-			hash += ((uint8_t*)&(pf->uuid))[i];
+			memcpy(&ftrs[copied], &(ps->features[index]), sizeof(nx_uuid_t));
+			copied++;
 		}
-		pf = pf->next;
+
+		if (NULL != pinfo)
+		{
+			read_info(ps, pinfo);
+		}
+
+		if ( ! read_retry(ps, seq))
+		{
+			return copied;
+		}
+		debug1("rtry");
 	}
-	return hash;
 }
 
-bool devf_get_feature (uint8_t fnum, nx_uuid_t* pftr)
+bool devf_has_feature (const nx_uuid_t * puuid)
 {
-	device_feature_t * pf = mp_features;
-	for (uint8_t i=0; i < fnum; i++)
+	for (;;)
 	{
-		if  (NULL == pf)
+		uint32_t seq;
+		const devf_snapshot_t * ps = read_begin(&seq);
+		bool found = false;
+
+		// The filter rules out most absent features without a scan
+		if (feature_filter_test(ps->filter, sizeof(ps->filter), puuid))
 		{
-			return false;
+			for (uint8_t index = 0; index < ps->count; index++)
+			{
+				if (0 == memcmp(&(ps->features[index]), puuid, sizeof(nx_uuid_t)))
+				{
+					found = true;
+					break;
+				}
+			}
 		}
-		pf = pf->next;
+
+		if ( ! read_retry(ps, seq))
+		{
+			return found;
+		}
+		debug1("rtry");
 	}
-	if (NULL != pf)
+}
+
+void devf_get_filter (uint8_t filter[DEVF_FILTER_BYTES], devf_info_t * pinfo)
+{
+	const devf_snapshot_t * ps;
+	uint32_t seq;
+	do
 	{
-		memcpy(pftr, &(pf->uuid), sizeof(nx_uuid_t));
-		return true;
-	}
-	return false;
+		ps = read_begin(&seq);
+		memcpy(filter, ps->filter, DEVF_FILTER_BYTES);
+		if (NULL != pinfo)
+		{
+			read_info(ps, pinfo);
+		}
+	} while (read_retry(ps, seq));
+}
+
+bool devf_get_feature (uint8_t fnum, nx_uuid_t* pftr)
+{
+	return 1 == devf_get_features(fnum, pftr, 1, NULL);
 }
 
 bool devf_add_feature (device_feature_t * pftr, nx_uuid_t * puuid)
 {
+	while (osOK != osMutexAcquire(m_write_mutex, osWaitForever));
+
+	if (m_count >= DEVF_MAX_FEATURES)
+	{
+		osMutexRelease(m_write_mutex);
+		err1("full %u", (unsigned int)DEVF_MAX_FEATURES); // Raise DEVF_MAX_FEATURES
+		return false;
+	}
+
 	device_feature_t * pf = mp_features;
 	while (NULL != pf)
 	{
@@ -70,6 +236,7 @@ bool devf_add_feature (device_feature_t * pftr, nx_uuid_t * puuid)
 		debug1("%d %p %p %p %p %d", (int)m_count, pftr, puuid, pf, &(pf->uuid), sizeof(nx_uuid_t));
 		if ((pf == pftr)||(0 == memcmp(&(pf->uuid), puuid, sizeof(nx_uuid_t))))
 		{
+			osMutexRelease(m_write_mutex);
 			warnb1("dup %p %p", puuid, sizeof(nx_uuid_t), pftr, pf);
 			return false;
 		}
@@ -83,6 +250,9 @@ bool devf_add_feature (device_feature_t * pftr, nx_uuid_t * puuid)
 		}
 	}
 
+	memcpy(&(pftr->uuid), puuid, sizeof(nx_uuid_t));
+	pftr->next = NULL;
+
 	if (NULL == pf)
 	{
 		mp_features = pftr;
@@ -92,21 +262,25 @@ bool devf_add_feature (device_feature_t * pftr, nx_uuid_t * puuid)
 		pf->next = pftr; // Append to the end
 	}
 
-	memcpy(&(pftr->uuid), puuid, sizeof(nx_uuid_t));
-	pftr->next = NULL;
 	m_count++;
+	publish();
+
+	osMutexRelease(m_write_mutex);
 	return true;
 }
 
 bool devf_remove_feature (device_feature_t * pftr)
 {
+	bool removed = false;
+
+	while (osOK != osMutexAcquire(m_write_mutex, osWaitForever));
+
 	if (NULL != mp_features)
 	{
 		if (mp_features == pftr)
 		{
 			mp_features = mp_features->next;
-			m_count--;
-			return true;
+			removed = true;
 		}
 		else
 		{
@@ -116,12 +290,20 @@ bool devf_remove_feature (device_feature_t * pftr)
 				if (pf->next == pftr)
 				{
 					pf->next = pf->next->next;
-					m_count--;
-					return true;
+					removed = true;
+					break;
 				}
-				pf = pftr->next;
+				pf = pf->next;
 			}
 		}
 	}
-	return false;
+
+	if (removed)
+	{
+		m_count--;
+		publish(); // Readers never see list elements, pftr is free now
+	}
+
+	osMutexRelease(m_write_mutex);
+	return removed;
 }
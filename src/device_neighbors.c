@@ -0,0 +1,301 @@
+/**
+ * Fixed-capacity neighbor table, open addressing with linear probing.
+ *
+ * Copyright Thinnect Inc. 2026
+ * @author Raido Pahtma
+ * @license MIT
+ */
+#include "device_neighbors.h"
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "endianness.h"
+
+#include "cmsis_os2_ext.h"
+
+#include "loglevels.h"
+#define __MODUUL__ "DevN"
+#define __LOG_LEVEL__ ( LOG_LEVEL_device_neighbors & BASE_LOG_LEVEL )
+#include "log.h"
+
+#if (DEVN_CAPACITY & (DEVN_CAPACITY - 1)) != 0
+#error "DEVN_CAPACITY must be a power of 2"
+#endif
+
+#define DEVN_MASK (DEVN_CAPACITY - 1)
+
+typedef struct neighbor_slot {
+	bool used;
+	device_neighbor_t info;
+} neighbor_slot_t;
+
+static neighbor_slot_t m_neighbors[DEVN_CAPACITY];
+static uint8_t m_count;
+
+static osMutexId_t m_mutex;
+
+static uint8_t home_slot (const uint8_t guid[8])
+{
+	uint32_t hash = 0x811C9DC5; // FNV-1a
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		hash = (hash ^ guid[i]) * 0x01000193;
+	}
+	return (uint8_t)(hash & DEVN_MASK);
+}
+
+// Returns the slot holding guid or the first free slot of its probe sequence,
+// DEVN_CAPACITY if the table is full and guid is not in it.
+static uint8_t find_slot (const uint8_t guid[8])
+{
+	uint8_t slot = home_slot(guid);
+	for (uint16_t i = 0; i < DEVN_CAPACITY; i++)
+	{
+		if (( ! m_neighbors[slot].used)
+		  ||(0 == memcmp(m_neighbors[slot].info.guid, guid, 8)))
+		{
+			return slot;
+		}
+		slot = (slot + 1) & DEVN_MASK;
+	}
+	return DEVN_CAPACITY;
+}
+
+// Backward-shift deletion, keeps probe sequences intact without tombstones
+static void remove_slot (uint8_t slot)
+{
+	uint8_t hole = slot;
+	uint8_t next = slot;
+	for (uint16_t i = 1; i < DEVN_CAPACITY; i++)
+	{
+		next = (next + 1) & DEVN_MASK;
+		if ( ! m_neighbors[next].used)
+		{
+			break;
+		}
+
+		uint8_t home = home_slot(m_neighbors[next].info.guid);
+		bool stays = (hole <= next) ? ((hole < home) && (home <= next))
+		                            : ((hole < home) || (home <= next));
+		if ( ! stays)
+		{
+			m_neighbors[hole] = m_neighbors[next];
+			hole = next;
+		}
+	}
+	m_neighbors[hole].used = false;
+	m_count--;
+}
+
+static uint8_t oldest_slot (uint32_t now)
+{
+	uint8_t oldest = 0;
+	uint32_t oldest_age = 0;
+	for (uint16_t i = 0; i < DEVN_CAPACITY; i++)
+	{
+		if (m_neighbors[i].used)
+		{
+			uint32_t age = now - m_neighbors[i].info.last_seen;
+			if (age >= oldest_age)
+			{
+				oldest_age = age;
+				oldest = i;
+			}
+		}
+	}
+	return oldest;
+}
+
+void devn_init ()
+{
+	memset(m_neighbors, 0, sizeof(m_neighbors));
+	m_count = 0;
+
+	const osMutexAttr_t devn_mutex_attr = { "devn", osMutexPrioInherit, NULL, 0U };
+	m_mutex = osMutexNew(&devn_mutex_attr);
+}
+
+uint8_t devn_update (const device_announcement_t * pa, am_addr_t source)
+{
+	uint8_t changes = 0;
+	uint32_t now = osCounterGetSecond();
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	uint8_t slot = find_slot(pa->guid);
+	if (DEVN_CAPACITY == slot)
+	{
+		uint8_t evict = oldest_slot(now);
+		debugb1("evict", m_neighbors[evict].info.guid, 8);
+		remove_slot(evict);
+		slot = find_slot(pa->guid);
+	}
+
+	device_neighbor_t * pn = &(m_neighbors[slot].info);
+	device_neighbor_t nb;
+
+	memcpy(nb.guid, pa->guid, 8);
+	nb.address = source;
+	nb.boot_number = ntoh32(pa->boot_number);
+	nb.announcement = ntoh32(pa->announcement);
+	nb.uuid = pa->uuid;
+	nb.position_type = pa->position_type;
+	nb.latitude = ntoh32(pa->latitude);
+	nb.longitude = ntoh32(pa->longitude);
+	nb.elevation = ntoh32(pa->elevation);
+	nb.radio_tech = pa->radio_tech;
+	nb.radio_channel = pa->radio_channel;
+	nb.ident_timestamp = ntoh64(pa->ident_timestamp);
+	nb.feature_list_hash = ntoh32(pa->feature_list_hash);
+	nb.last_seen = now;
+
+	if (m_neighbors[slot].used)
+	{
+		if ((nb.boot_number != pn->boot_number)||(nb.announcement < pn->announcement))
+		{
+			changes |= DEVN_CHANGED_BOOT;
+		}
+		if ((nb.ident_timestamp != pn->ident_timestamp)
+		  ||(0 != memcmp(&(nb.uuid), &(pn->uuid), sizeof(nx_uuid_t))))
+		{
+			changes |= DEVN_CHANGED_IDENT;
+		}
+		if (nb.feature_list_hash != pn->feature_list_hash)
+		{
+			changes |= DEVN_CHANGED_FEATURES;
+		}
+		if ((nb.position_type != pn->position_type)
+		  ||(nb.latitude != pn->latitude)||(nb.longitude != pn->longitude)
+		  ||(nb.elevation != pn->elevation))
+		{
+			changes |= DEVN_CHANGED_POSITION;
+		}
+		if ((nb.radio_tech != pn->radio_tech)||(nb.radio_channel != pn->radio_channel))
+		{
+			changes |= DEVN_CHANGED_RADIO;
+		}
+		if (nb.address != pn->address)
+		{
+			changes |= DEVN_CHANGED_ADDRESS;
+		}
+	}
+	else
+	{
+		m_neighbors[slot].used = true;
+		m_count++;
+		changes = DEVN_CHANGED_NEW;
+	}
+
+	*pn = nb;
+
+	osMutexRelease(m_mutex);
+
+	return changes;
+}
+
+bool devn_get (const uint8_t guid[8], device_neighbor_t * pn)
+{
+	bool found = false;
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	uint8_t slot = find_slot(guid);
+	if ((DEVN_CAPACITY != slot) && (m_neighbors[slot].used))
+	{
+		if (NULL != pn)
+		{
+			*pn = m_neighbors[slot].info;
+		}
+		found = true;
+	}
+
+	osMutexRelease(m_mutex);
+
+	return found;
+}
+
+uint8_t devn_count ()
+{
+	return m_count;
+}
+
+bool devn_next (uint8_t * pindex, device_neighbor_t * pn)
+{
+	bool found = false;
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	while (*pindex < DEVN_CAPACITY)
+	{
+		uint8_t slot = (*pindex)++;
+		if (m_neighbors[slot].used)
+		{
+			*pn = m_neighbors[slot].info;
+			found = true;
+			break;
+		}
+	}
+
+	osMutexRelease(m_mutex);
+
+	return found;
+}
+
+uint8_t devn_expire (uint32_t max_age_s)
+{
+	uint8_t removed = 0;
+	uint32_t now = osCounterGetSecond();
+	uint16_t start = DEVN_CAPACITY;
+
+	while (osOK != osMutexAcquire(m_mutex, osWaitForever));
+
+	// Scan from a free slot, entries are never shifted across it, so an entry
+	// never moves into a slot that has already been scanned
+	for (uint16_t i = 0; i < DEVN_CAPACITY; i++)
+	{
+		if ( ! m_neighbors[i].used)
+		{
+			start = i;
+			break;
+		}
+	}
+	if (DEVN_CAPACITY == start) // Full, removing any expired entry frees a slot
+	{
+		for (uint16_t i = 0; i < DEVN_CAPACITY; i++)
+		{
+			if (now - m_neighbors[i].info.last_seen > max_age_s)
+			{
+				remove_slot(i);
+				removed++;
+				break;
+			}
+		}
+		for (uint16_t i = 0; (0 != removed) && (i < DEVN_CAPACITY); i++)
+		{
+			if ( ! m_neighbors[i].used)
+			{
+				start = i;
+				break;
+			}
+		}
+	}
+
+	for (uint16_t n = 1; (DEVN_CAPACITY != start) && (n < DEVN_CAPACITY);)
+	{
+		uint8_t i = (start + n) & DEVN_MASK;
+		if ((m_neighbors[i].used) && (now - m_neighbors[i].info.last_seen > max_age_s))
+		{
+			remove_slot(i); // Something else may be shifted into the slot
+			removed++;
+		}
+		else
+		{
+			n++;
+		}
+	}
+
+	osMutexRelease(m_mutex);
+
+	return removed;
+}
@@ -20,6 +20,11 @@ uint32_t osCounterGetSecond (void)
 	return fake_localtime;
 }
 
+uint32_t osCounterGetMilli (void)
+{
+	return fake_localtime * 1000;
+}
+
 osMutexId_t osMutexNew (const osMutexAttr_t * attr)
 {
 	return (osMutexId_t)1;
@@ -50,6 +55,11 @@ osThreadId_t osThreadNew (osThreadFunc_t func, void *argument, const osThreadAtt
 	return (osThreadId_t)1;
 }
 
+uint32_t osThreadGetStackSpace (osThreadId_t thread_id)
+{
+	return 512;
+}
+
 uint32_t osThreadFlagsWait (uint32_t flags, uint32_t options, uint32_t timeout)
 {
 	uint32_t fl = m_flags;
@@ -131,3 +141,41 @@ osStatus_t osDelay (uint32_t ticks)
 {
 	return osOK;
 }
+
+
+// Single thread semaphore emulation, a wait that can't succeed takes the
+// timeout off the fake clock ----------------------------------------------------
+
+static uint32_t m_sem_count = 0;
+
+osSemaphoreId_t osSemaphoreNew (uint32_t max_count, uint32_t initial_count, const osSemaphoreAttr_t *attr)
+{
+	m_sem_count = initial_count;
+	return (osSemaphoreId_t)1;
+}
+
+osStatus_t osSemaphoreAcquire (osSemaphoreId_t semaphore_id, uint32_t timeout)
+{
+	if (m_sem_count > 0)
+	{
+		m_sem_count--;
+		return osOK;
+	}
+	fake_localtime += (timeout + 999) / 1000;
+	return osErrorTimeout;
+}
+
+osStatus_t osSemaphoreRelease (osSemaphoreId_t semaphore_id)
+{
+	if (m_sem_count > 0)
+	{
+		return osErrorResource; // Binary
+	}
+	m_sem_count++;
+	return osOK;
+}
+
+osStatus_t osSemaphoreDelete (osSemaphoreId_t semaphore_id)
+{
+	return osOK;
+}
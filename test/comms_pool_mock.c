@@ -0,0 +1,38 @@
+/*
+ * A message pool mock for the device announcement unit tests. The number of
+ * messages that can be taken is limited by fake_pool_limit, so tests can run
+ * the pool empty and check that all messages are returned.
+ *
+ * Copyright Thinnect Inc. 2021
+ * @license MIT
+ */
+
+#include "mist_comm_pool.h"
+
+#include <stdlib.h>
+
+uint8_t fake_pool_limit = 255;
+uint8_t fake_pool_taken = 0;
+
+comms_msg_t * comms_pool_get (comms_pool_t * pool, uint32_t timeout_ms)
+{
+	comms_msg_t * msg = NULL;
+	if (fake_pool_taken < fake_pool_limit)
+	{
+		msg = calloc(1, sizeof(comms_msg_t));
+		if (NULL != msg)
+		{
+			fake_pool_taken++;
+		}
+	}
+	return msg;
+}
+
+void comms_pool_put (comms_pool_t * pool, comms_msg_t * msg)
+{
+	if (NULL != msg)
+	{
+		fake_pool_taken--;
+		free(msg);
+	}
+}
@@ -2,7 +2,14 @@
 #define DEVICE_ANNOUNCEMENT_TEST_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-uint32_t unittest_process_announcements (uint32_t flags, uint32_t current_timeout_s);
+#include "device_announcement.h"
+
+uint32_t unittest_process_announcements (uint32_t flags);
+
+bool unittest_push_request (device_announcer_t * p_anc, const device_announcement_request_t * p_req);
+
+bool unittest_pop_request (device_announcer_t * p_anc, device_announcement_request_t * p_req);
 
 #endif//DEVICE_ANNOUNCEMENT_TEST_H
@@ -6,5 +6,6 @@
 #define LOG_LEVEL_test                LOG_LEVEL_DEBUG
 #define LOG_LEVEL_device_announcement LOG_LEVEL_DEBUG
 #define LOG_LEVEL_device_features     LOG_LEVEL_DEBUG
+#define LOG_LEVEL_device_neighbors    LOG_LEVEL_DEBUG
 
 #endif//LOGLEVELS_H
@@ -4,8 +4,12 @@
  * Copyright Thinnect 2019.
  * @license MIT
  */
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "loglevels.h"
 #define __MODUUL__ "test"
@@ -14,13 +18,18 @@
 
 #include "device_announcement_test.h"
 
+#include "cmsis_os2.h"
+
 #include "DeviceSignature.h"
 #include "SignatureAreaFile.h"
 #include "mist_comm.h"
 #include "mist_comm_am.h"
 #include "device_announcement.h"
 #include "device_features.h"
+#include "DeviceFeatureFilter.h"
+#include "device_neighbors.h"
 #include "node_coordinates.h"
+#include "endianness.h"
 
 #include <time.h>
 #include "nesc_to_c_compat.h"
@@ -30,6 +39,9 @@ uint8_t packets_sent = 0;
 
 uint32_t fake_localtime = 0;
 
+extern uint8_t fake_pool_limit;
+extern uint8_t fake_pool_taken;
+
 uint32_t node_lifetime_seconds (void)
 {
 	return fake_localtime + 100;
@@ -55,8 +67,18 @@ time_t time (time_t * t)
 	return tt;
 }
 
+bool fake_coordinates_known = false;
+
 bool node_coordinates_get(coordinates_geo_t * geo)
 {
+	if (fake_coordinates_known)
+	{
+		geo->latitude = 59437000;
+		geo->longitude = 24745000;
+		geo->elevation = 1200;
+		geo->type = 'G';
+		return true;
+	}
 	geo->latitude = 0;
 	geo->longitude = 0;
 	geo->elevation = 0;
@@ -165,7 +187,7 @@ int testPeriodicAnnouncements() {
 	deva_add_announcer(&announcer, radio, NULL, 10);
 
 	for(uint8_t i=0;i<60;i++) {
-		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0), 0);
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
 		fake_localtime++;
 		if(_sdf1 != NULL) {
 			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
@@ -185,6 +207,122 @@ int testPeriodicAnnouncements() {
 }
 //------------------------------------------------------------------------------
 
+//------------------------------------------------------------------------------
+// Accepts several messages, from any layer, until completed by the test
+typedef struct fake_send {
+	comms_layer_t* comms;
+	comms_msg_t* msg;
+	comms_send_done_f* sdf;
+	void* user;
+} fake_send_t;
+
+fake_send_t fake_sends[4];
+uint8_t fake_sends_pending = 0;
+
+comms_error_t fake_comms_send_queued(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	if(fake_sends_pending >= sizeof(fake_sends)/sizeof(fake_sends[0])) {
+		return COMMS_EBUSY;
+	}
+	fake_sends[fake_sends_pending].comms = (comms_layer_t*)comms;
+	fake_sends[fake_sends_pending].msg = msg;
+	fake_sends[fake_sends_pending].sdf = sdf;
+	fake_sends[fake_sends_pending].user = user;
+	fake_sends_pending++;
+	packets_sent++;
+	return COMMS_SUCCESS;
+}
+
+uint8_t fake_sends_complete(comms_error_t result) {
+	uint8_t completed = fake_sends_pending;
+	fake_sends_pending = 0;
+	for(uint8_t i=0;i<completed;i++) {
+		fake_sends[i].sdf(fake_sends[i].comms, fake_sends[i].msg, result, fake_sends[i].user);
+	}
+	return completed;
+}
+
+int testDeadlineScheduling() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	fake_sends_pending = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio1 = (comms_layer_t*)r1;
+	comms_am_create(radio1, 1, &fake_comms_send_queued, &fake_comms_len, NULL, NULL);
+	uint8_t r2[512];
+	comms_layer_t* radio2 = (comms_layer_t*)r2;
+	comms_am_create(radio2, 2, &fake_comms_send_queued, &fake_comms_len, NULL, NULL);
+
+	device_announcer_t silent;
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&silent, radio1, NULL, 0);
+	if(unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0)) != osWaitForever) {
+		err1("testDeadlineScheduling - woken without announcements");
+		return 1;
+	}
+
+	deva_add_announcer(&announcer, radio1, NULL, 10);
+	uint32_t deadline = unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+	if((deadline == 0)||(deadline > 1000)) { // First one within period/10
+		err1("testDeadlineScheduling - first: %"PRIu32, deadline);
+		return 1;
+	}
+
+	// Woken exactly at every deadline, 2 second intervals for the first
+	// announcements and then the period, counted from the previous deadline
+	uint8_t sent = 0;
+	for(uint8_t i=1;i<30;i++) {
+		fake_localtime = i;
+		uint32_t now = i * 1000UL;
+		uint32_t timeout = unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if(fake_sends_complete(COMMS_SUCCESS) > 0) {
+			timeout = unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		}
+		while(deadline <= now) {
+			sent++;
+			deadline += (sent < 5) ? 2000 : 10000;
+		}
+		if(timeout != deadline - now) {
+			err1("testDeadlineScheduling - %d: %"PRIu32" != %"PRIu32, i, timeout, deadline - now);
+			test_errors++;
+		}
+	}
+	if((packets_sent != 7)||(sent != 7)) {
+		err1("testDeadlineScheduling - packets: %d/%d != 7", packets_sent, sent);
+		return 1;
+	}
+
+	// Announcers that are due at the same time are all sent in one wakeup
+	fake_localtime = 0;
+	packets_sent = 0;
+	device_announcer_t announcer2;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio1, NULL, 10);
+	deva_add_announcer(&announcer2, radio2, NULL, 10);
+	unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+	fake_localtime = 1;
+	unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+	if((packets_sent != 2)||(fake_sends_complete(COMMS_SUCCESS) != 2)) {
+		err1("testDeadlineScheduling - together: %d != 2", packets_sent);
+		return 1;
+	}
+	unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+
+	if(test_errors > 0) {
+		err1("testDeadlineScheduling - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
 //------------------------------------------------------------------------------
 comms_error_t fake_comms_send2(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
 	comms_layer_t* c = (comms_layer_t*)comms;
@@ -241,7 +379,7 @@ int testDescriptionResponse() {
 	deva_add_announcer(&announcer, radio, NULL, 0);
 
 	for(uint8_t i=0;i<60;i++) {
-		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0), 0);
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
 		fake_localtime++;
 		if(_sdf1 != NULL) {
 			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
@@ -253,7 +391,7 @@ int testDescriptionResponse() {
 			comms_set_packet_type(radio, &msg, 0xDA);
 			memcpy(comms_get_payload(radio, &msg, 2), "\x11\x02", 2);
 			comms_set_payload_length(radio, &msg, 2);
-			comms_am_set_destination(radio, &msg, 0xFFFF);
+			comms_am_set_destination(radio, &msg, 1);
 			comms_am_set_source(radio, &msg, 0x1234);
 			comms_deliver(radio, &msg);
 		}
@@ -296,7 +434,7 @@ comms_error_t fake_comms_send3(comms_layer_iface_t* comms, comms_msg_t* msg, com
 		"\x00\x00\x00\x00" // elevation
 		"\x01\x00" // radio tech+channel
 		"\x01\x02\x03\x04\x05\x06\x07\x08" // IDENT_TIMESTAMP
-		"\x00\x00\x06\xd8" // feature hash
+		"\x35\x43\x3a\x5d" // feature hash
 		;
 		if(memcmp(ref, payload, length) != 0) {
 			err1("payload mismatch");
@@ -374,7 +512,7 @@ int testListFeaturesResponse() {
 	deva_add_announcer(&announcer, radio, NULL, 0);
 
 	for(uint8_t i=0;i<30;i++) {
-		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0), 0);
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
 		fake_localtime++;
 		if(_sdf1 != NULL) {
 			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
@@ -386,7 +524,7 @@ int testListFeaturesResponse() {
 			comms_set_packet_type(radio, &msg, 0xDA);
 			memcpy(comms_get_payload(radio, &msg, 2), "\x10\x02", 2);
 			comms_set_payload_length(radio, &msg, 2);
-			comms_am_set_destination(radio, &msg, 0xFFFF);
+			comms_am_set_destination(radio, &msg, 1);
 			comms_am_set_source(radio, &msg, 0x1234);
 			comms_deliver(radio, &msg);
 		}
@@ -396,7 +534,7 @@ int testListFeaturesResponse() {
 			comms_set_packet_type(radio, &msg, 0xDA);
 			memcpy(comms_get_payload(radio, &msg, 3), "\x12\x02\x00", 3);
 			comms_set_payload_length(radio, &msg, 3);
-			comms_am_set_destination(radio, &msg, 0xFFFF);
+			comms_am_set_destination(radio, &msg, 1);
 			comms_am_set_source(radio, &msg, 0x1234);
 			comms_deliver(radio, &msg);
 		}
@@ -406,7 +544,7 @@ int testListFeaturesResponse() {
 			comms_set_packet_type(radio, &msg, 0xDA);
 			memcpy(comms_get_payload(radio, &msg, 3), "\x12\x02\x01", 3);
 			comms_set_payload_length(radio, &msg, 3);
-			comms_am_set_destination(radio, &msg, 0xFFFF);
+			comms_am_set_destination(radio, &msg, 1);
 			comms_am_set_source(radio, &msg, 0x1234);
 			comms_deliver(radio, &msg);
 		}
@@ -426,59 +564,336 @@ int testListFeaturesResponse() {
 //------------------------------------------------------------------------------
 
 //------------------------------------------------------------------------------
-int testFeatureManagement() {
+comms_error_t fake_comms_send4(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	comms_layer_t* c = (comms_layer_t*)comms;
+	uint8_t length = comms_get_payload_length(c, msg);
+	uint8_t* payload = (uint8_t*)comms_get_payload(c, msg, length);
+	debugb1("send4", payload, length);
+	packets_sent++;
+
+	if(_sdf1 == NULL) {
+		_msg1 = msg;
+		_sdf1 = sdf;
+		_user1 = user;
+		return COMMS_SUCCESS;
+	}
+	return COMMS_EBUSY;
+}
+
+void deliverRequestTo(comms_layer_t* radio, am_addr_t source, am_addr_t destination, const char* request, uint8_t length) {
+	comms_msg_t msg;
+	comms_init_message(radio, &msg);
+	comms_set_packet_type(radio, &msg, 0xDA);
+	memcpy(comms_get_payload(radio, &msg, length), request, length);
+	comms_set_payload_length(radio, &msg, length);
+	comms_am_set_destination(radio, &msg, destination);
+	comms_am_set_source(radio, &msg, source);
+	comms_deliver(radio, &msg);
+}
+
+void deliverRequest(comms_layer_t* radio, am_addr_t source, const char* request, uint8_t length) {
+	deliverRequestTo(radio, source, 0xFFFF, request, length);
+}
+
+int testQueryCoalescing() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	sigAreaInit("fakesignature.bin");
+	sigInit();
+
 	devf_init();
-	device_feature_t dftrs[4];
 
-	devf_add_feature(&dftrs[0], (nx_uuid_t*)"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x10\x11\x12\x13\x14\x15\x16");
-	if(devf_count() != 1) {
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<30;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 5) { // Duplicates are merged, different sources get one broadcast
+			deliverRequest(radio, 0x1234, "\x10\x02", 2);
+			deliverRequest(radio, 0x1234, "\x10\x02", 2);
+			deliverRequest(radio, 0x4321, "\x10\x02", 2);
+			deliverRequest(radio, 0x1234, "\x10\x02", 2);
+			deliverRequest(radio, 0x1234, "\x12\x02\x00", 3);
+			deliverRequest(radio, 0x1234, "\x12\x02\x01", 3);
+			deliverRequest(radio, 0x1234, "\x12\x02\x00", 3);
+		}
+	}
+
+	if(packets_sent != 3) {
+		err1("testQueryCoalescing - packet count: %d != %d", packets_sent, 3);
 		return 1;
 	}
-	if(devf_hash() != 0xb2) {
-		return 2;
+	if(test_errors > 0) {
+		err1("testQueryCoalescing - errors: %"PRIu32, test_errors);
+		return 1;
 	}
 
-	devf_add_feature(&dftrs[1], (nx_uuid_t*)"\x17\x18\x19\x20\x21\x22\x23\x24\x25\x26\x27\x28\x29\x30\x31\x32");
-	if(devf_count() != 2) {
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testRequestRing() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	// A flood of the same request takes up one entry
+	for(uint8_t i=0;i<DEVA_RATE_SOURCE_BURST;i++) {
+		deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+	}
+	deva_stats_t stats;
+	deva_get_stats(&announcer, &stats);
+	uint8_t pending = announcer.requests_head - announcer.requests_tail;
+	if((pending != 1)||(stats.queue_overflows != 0)||(stats.rate_limited != 0)) {
+		err1("testRequestRing - flood: %d %"PRIu32" %"PRIu32, pending, stats.queue_overflows, stats.rate_limited);
 		return 1;
 	}
-	if(devf_hash() != 0x2fa) {
-		return 2;
+
+	// Different requests fill the ring, the rest overflows
+	fake_localtime += 10; // Rate limiting tokens back
+	for(uint8_t i=0;i<10;i++) {
+		deliverRequestTo(radio, 0x2000 + i, 1, "\x11\x02", 2);
+	}
+	deva_get_stats(&announcer, &stats);
+	pending = announcer.requests_head - announcer.requests_tail;
+	if((pending != DEVA_ACTION_QUEUE_LENGTH)||(stats.queue_overflows != 11 - DEVA_ACTION_QUEUE_LENGTH)) {
+		err1("testRequestRing - overflow: %d %"PRIu32, pending, stats.queue_overflows);
+		return 1;
 	}
 
-	devf_add_feature(&dftrs[2], (nx_uuid_t*)"\x33\x34\x35\x36\x37\x38\x39\x40\x41\x42\x43\x44\x45\x46\x47\x48");
-	if(devf_count() != 3) {
+	for(uint8_t i=0;i<30;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+	}
+	if(announcer.requests_head != announcer.requests_tail) {
+		err1("testRequestRing - not drained");
 		return 1;
 	}
-	if(devf_hash() != 0x6d8) {
-		return 2;
+
+	deva_remove_announcer(&announcer);
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+#define RING_TEST_REQUESTS 100000
+
+device_announcer_t ring_announcer;
+
+void* request_producer(void* arg) {
+	for(uint32_t i=0;i<RING_TEST_REQUESTS;i++) {
+		device_announcement_request_t req;
+		memset(&req, 0, sizeof(req));
+		req.action = DEVA_DESCRIBE;
+		req.address = (uint16_t)i;
+		req.received = i;
+		req.ident_timestamp = (uint64_t)i * 0x100000001ULL;
+		while(!unittest_push_request(&ring_announcer, &req)) {
+			sched_yield(); // Full, wait for the consumer
+		}
 	}
+	return NULL;
+}
 
-	devf_add_feature(&dftrs[3], (nx_uuid_t*)"\x49\x50\x51\x52\x53\x54\x55\x56\x57\x58\x59\x60\x61\x62\x63\x64");
-	if(devf_count() != 4) {
+int testRequestRingThreads() {
+	atomic_init(&ring_announcer.requests_head, 0);
+	atomic_init(&ring_announcer.requests_tail, 0);
+
+	pthread_t producer;
+	pthread_create(&producer, NULL, request_producer, NULL);
+
+	uint32_t expected = 0;
+	uint32_t errors = 0;
+	while(expected < RING_TEST_REQUESTS) {
+		device_announcement_request_t req;
+		if(!unittest_pop_request(&ring_announcer, &req)) {
+			sched_yield();
+			continue;
+		}
+		if((req.received != expected)||(req.address != (uint16_t)expected)
+		 ||(req.ident_timestamp != (uint64_t)expected * 0x100000001ULL)) {
+			errors++; // Lost, reordered or torn
+		}
+		expected = req.received + 1;
+	}
+
+	pthread_join(producer, NULL);
+
+	if(errors != 0) {
+		err1("testRequestRingThreads - errors: %"PRIu32, errors);
 		return 1;
 	}
-	if(devf_hash() != 0xc58) {
-		return 2;
+	if(ring_announcer.requests_head != ring_announcer.requests_tail) {
+		err1("testRequestRingThreads - not empty");
+		return 1;
 	}
+	return 0;
+}
+//------------------------------------------------------------------------------
 
-	devf_remove_feature(&dftrs[1]); // Remove second element
-	if(devf_count() != 3) {
-		return 1;
+//------------------------------------------------------------------------------
+int testBroadcastBackoff() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<10;i++) {
+		uint32_t timeout = unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&(packets_sent != 1)) { // Unicast is answered right away
+			err1("testBroadcastBackoff - unicast count: %d != %d", packets_sent, 1);
+			return 1;
+		}
+		if(i == 4) { // Broadcast is waiting for a random time within the window
+			if((packets_sent != 1)||(timeout == 0)||(timeout > 2000)) {
+				err1("testBroadcastBackoff - broadcast %d %"PRIu32, packets_sent, timeout);
+				return 1;
+			}
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 3) {
+			deliverRequestTo(radio, 0x1234, 0xFFFF, "\x10\x02", 2);
+			srand(1); // Deterministic delay
+		}
 	}
 
-	devf_remove_feature(&dftrs[0]); // Remove first element
-	if(devf_count() != 2) {
+	if(packets_sent != 2) {
+		err1("testBroadcastBackoff - packet count: %d != %d", packets_sent, 2);
 		return 1;
 	}
-
-	devf_remove_feature(&dftrs[3]); // Remove last element
-	if(devf_count() != 1) {
+	if(test_errors > 0) {
+		err1("testBroadcastBackoff - errors: %"PRIu32, test_errors);
 		return 1;
 	}
 
-	devf_remove_feature(&dftrs[2]); // Remove the only remaining element
-	if(devf_count() != 0) {
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+am_addr_t last_destination = 0;
+
+comms_error_t fake_comms_send5(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	last_destination = comms_am_get_destination((comms_layer_t*)comms, msg);
+	return fake_comms_send4(comms, msg, sdf, user);
+}
+
+int testResponseCache() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send5, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<12;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&((packets_sent != 1)||(last_destination != 0x1234))) {
+			test_errors++; // First requester gets its own answer
+		}
+		if((i == 3)&&((packets_sent != 2)||(last_destination != 0xFFFF))) {
+			test_errors++; // Second requester within the window, answer everyone
+		}
+		if((i == 4)&&(packets_sent != 2)) {
+			test_errors++; // Third requester already heard the broadcast
+		}
+		if((i == 10)&&((packets_sent != 3)||(last_destination != 0x5678))) {
+			test_errors++; // Window has passed
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+		}
+		if(i == 2) {
+			deliverRequestTo(radio, 0x4321, 1, "\x11\x02", 2);
+		}
+		if(i == 3) {
+			deliverRequestTo(radio, 0x1111, 1, "\x11\x02", 2);
+		}
+		if(i == 9) {
+			deliverRequestTo(radio, 0x5678, 1, "\x11\x02", 2);
+		}
+	}
+
+	if(packets_sent != 3) {
+		err1("testResponseCache - packet count: %d != %d", packets_sent, 3);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testResponseCache - errors: %"PRIu32, test_errors);
 		return 1;
 	}
 
@@ -486,14 +901,1785 @@ int testFeatureManagement() {
 }
 //------------------------------------------------------------------------------
 
+//------------------------------------------------------------------------------
+int testRateLimit() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send5, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<10;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) { // Flood from one source, the rest is dropped
+			for(uint8_t j=0;j<DEVA_RATE_SOURCE_BURST+12;j++) {
+				deliverRequestTo(radio, 0xBAD, 1, "\x12\x02\x00", 3);
+			}
+		}
+		if(i == 2) { // Others are still served
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02", 2);
+		}
+	}
+
+	if(deva_dropped_requests() != 12) {
+		err1("testRateLimit - dropped: %"PRIu32" != %d", deva_dropped_requests(), 12);
+		return 1;
+	}
+	deva_stats_t stats;
+	deva_get_stats(&announcer, &stats);
+	if(stats.rate_limited != 12) { // Counted in the receive context
+		err1("testRateLimit - counted: %"PRIu32" != %d", stats.rate_limited, 12);
+		return 1;
+	}
+	if((packets_sent != 2)||(last_destination != 0x1234)) {
+		err1("testRateLimit - packet count: %d != %d", packets_sent, 2);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testRateLimit - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testListenWindow() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<30;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 3)&&(announcer.listen_ms != 2*1000+50)) {
+			test_errors++; // Follow-up 1 second after the first response
+		}
+		if((i == 25)&&(announcer.listen_ms != (2*1000+50)*3/4+1)) {
+			test_errors++; // Previous response was not followed by anything
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 2) {
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+		}
+		if(i == 20) {
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+		}
+	}
+
+	if(packets_sent != 3) {
+		err1("testListenWindow - packet count: %d != %d", packets_sent, 3);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testListenWindow - errors: %"PRIu32" %"PRIu32, test_errors, announcer.listen_ms);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+// Layers that start only when the test says so
+typedef struct fake_start {
+	comms_layer_t* comms;
+	comms_status_change_f* done;
+	void* user;
+} fake_start_t;
+
+fake_start_t fake_starts[2];
+uint8_t fake_starts_requested = 0;
+
+comms_error_t fake_comms_start(comms_layer_iface_t* comms, comms_status_change_f* start_done, void* user) {
+	fake_starts_requested++;
+	for(uint8_t i=0;i<sizeof(fake_starts)/sizeof(fake_starts[0]);i++) {
+		if((fake_starts[i].comms == NULL)||(fake_starts[i].comms == (comms_layer_t*)comms)) {
+			fake_starts[i].comms = (comms_layer_t*)comms;
+			fake_starts[i].done = start_done;
+			fake_starts[i].user = user;
+			return COMMS_SUCCESS;
+		}
+	}
+	return COMMS_EBUSY;
+}
+
+comms_error_t fake_comms_stop(comms_layer_iface_t* comms, comms_status_change_f* stop_done, void* user) {
+	stop_done((comms_layer_t*)comms, COMMS_STOPPED, user);
+	return COMMS_SUCCESS;
+}
+
+void fake_start_complete(comms_layer_t* comms) {
+	for(uint8_t i=0;i<sizeof(fake_starts)/sizeof(fake_starts[0]);i++) {
+		if(fake_starts[i].comms == comms) {
+			fake_starts[i].comms = NULL;
+			fake_starts[i].done(comms, COMMS_STARTED, fake_starts[i].user);
+		}
+	}
+}
+
+int testLateLayerStart() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	fake_sends_pending = 0;
+	fake_starts_requested = 0;
+	memset(fake_starts, 0, sizeof(fake_starts));
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio1 = (comms_layer_t*)r1;
+	comms_am_create(radio1, 1, &fake_comms_send_queued, &fake_comms_len, &fake_comms_start, &fake_comms_stop);
+	uint8_t r2[512];
+	comms_layer_t* radio2 = (comms_layer_t*)r2;
+	comms_am_create(radio2, 2, &fake_comms_send_queued, &fake_comms_len, &fake_comms_start, &fake_comms_stop);
+
+	devf_init();
+
+	comms_sleep_controller_t ctrl1;
+	comms_sleep_controller_t ctrl2;
+	device_announcer_t late; // Layer starts a second after it was asked to
+	device_announcer_t never; // Layer never starts
+	deva_init(NULL);
+	deva_add_announcer(&late, radio1, &ctrl1, 0);
+	deva_add_announcer(&never, radio2, &ctrl2, 0);
+
+	for(uint8_t i=0;i<10;i++) {
+		uint32_t timeout = unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&((fake_starts_requested != 2)||(packets_sent != 0)||(timeout > 5000))) {
+			test_errors++; // Waiting for both layers to start, at most DEVA_RADIO_START_TIMEOUT_MS
+		}
+		if((i == 3)&&((packets_sent != 1)||(fake_sends[0].comms != radio1))) {
+			test_errors++; // Sent from the status callback wakeup
+		}
+		if((i == 6)&&(never.msg == NULL)) {
+			test_errors++; // Still within the start timeout
+		}
+		if((i == 7)&&((never.msg != NULL)||(never.stats.stale != 1))) {
+			test_errors++; // Dropped at the start timeout
+		}
+		fake_localtime++;
+		fake_sends_complete(COMMS_SUCCESS);
+		if(i == 1) {
+			deliverRequestTo(radio1, 0x1234, 1, "\x10\x02", 2);
+			deliverRequestTo(radio2, 0x1234, 2, "\x10\x02", 2);
+		}
+		if(i == 2) {
+			fake_start_complete(radio1);
+		}
+	}
+
+	if(packets_sent != 1) {
+		err1("testLateLayerStart - packets: %d != %d", packets_sent, 1);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testLateLayerStart - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testSharedController() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	fake_sends_pending = 0;
+	fake_starts_requested = 0;
+	memset(fake_starts, 0, sizeof(fake_starts));
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio1 = (comms_layer_t*)r1;
+	comms_am_create(radio1, 1, &fake_comms_send_queued, &fake_comms_len, &fake_comms_start, &fake_comms_stop);
+	uint8_t r2[512];
+	comms_layer_t* radio2 = (comms_layer_t*)r2;
+	comms_am_create(radio2, 2, &fake_comms_send_queued, &fake_comms_len, &fake_comms_start, &fake_comms_stop);
+
+	devf_init();
+
+	// Announcements of announcers sharing a controller or a wake group are aligned
+	comms_sleep_controller_t ctrl;
+	comms_sleep_controller_t ctrl2;
+	device_announcer_t a1;
+	device_announcer_t a2;
+	device_announcer_t other;
+	deva_init(NULL);
+	if((!deva_add_announcer(&a1, radio1, &ctrl, 10))||(!deva_add_announcer(&a2, radio1, &ctrl, 20))) {
+		err1("testSharedController - add");
+		return 1;
+	}
+	// Another layer of the same radio, with its own controller
+	if((!deva_add_announcer(&other, radio2, &ctrl2, 10))||(!deva_set_wake_group(&a1, 1))||(!deva_set_wake_group(&other, 1))) {
+		err1("testSharedController - group");
+		return 1;
+	}
+	if((a1.deadline != a2.deadline)||(a1.deadline != other.deadline)) {
+		err1("testSharedController - not aligned: %"PRIu32" %"PRIu32" %"PRIu32, a1.deadline, a2.deadline, other.deadline);
+		return 1;
+	}
+
+	for(uint8_t i=0;i<3;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 1)&&((fake_starts_requested != 2)||(packets_sent != 0))) {
+			test_errors++; // One start for each layer, on the same wakeup
+		}
+		if((i == 2)&&(packets_sent != 3)) {
+			test_errors++; // All sent on the same wakeup
+		}
+		fake_localtime++;
+		fake_sends_complete(COMMS_SUCCESS);
+		if(i == 1) {
+			fake_start_complete(radio1);
+			fake_start_complete(radio2);
+		}
+	}
+
+	// The controller is handed over when the announcer that registered it is removed
+	fake_localtime = 0;
+	packets_sent = 0;
+	fake_starts_requested = 0;
+	deva_init(NULL);
+	comms_am_create(radio1, 1, &fake_comms_send_queued, &fake_comms_len, &fake_comms_start, &fake_comms_stop);
+	deva_add_announcer(&a1, radio1, &ctrl, 0);
+	deva_add_announcer(&a2, radio1, &ctrl, 0);
+	if(!deva_remove_announcer(&a1)) {
+		err1("testSharedController - remove");
+		return 1;
+	}
+
+	for(uint8_t i=0;i<5;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&((fake_starts_requested != 1)||(packets_sent != 0))) {
+			test_errors++; // Remaining announcer can start the layer
+		}
+		if((i == 3)&&(packets_sent != 1)) {
+			test_errors++;
+		}
+		fake_localtime++;
+		fake_sends_complete(COMMS_SUCCESS);
+		if(i == 1) {
+			deliverRequestTo(radio1, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 2) {
+			fake_start_complete(radio1);
+		}
+	}
+	deva_remove_announcer(&a2);
+
+	if(test_errors > 0) {
+		err1("testSharedController - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+fake_send_t fake_held;
+
+comms_error_t fake_comms_send_held(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	fake_held.comms = (comms_layer_t*)comms;
+	fake_held.msg = msg;
+	fake_held.sdf = sdf;
+	fake_held.user = user;
+	packets_sent++;
+	return COMMS_SUCCESS;
+}
+
+int testAwakeWindow() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	fake_sends_pending = 0;
+	fake_starts_requested = 0;
+	memset(fake_starts, 0, sizeof(fake_starts));
+	memset(&fake_held, 0, sizeof(fake_held));
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio1 = (comms_layer_t*)r1;
+	comms_am_create(radio1, 1, &fake_comms_send_queued, &fake_comms_len, &fake_comms_start, &fake_comms_stop);
+	uint8_t r2[512];
+	comms_layer_t* radio2 = (comms_layer_t*)r2;
+	comms_am_create(radio2, 2, &fake_comms_send_held, &fake_comms_len, &fake_comms_start, &fake_comms_stop);
+
+	devf_init();
+
+	comms_sleep_controller_t ctrl1;
+	comms_sleep_controller_t ctrl2;
+	device_announcer_t a1;
+	device_announcer_t a2; // Send-done does not come until the test says so
+	deva_init(NULL);
+	deva_add_announcer(&a1, radio1, &ctrl1, 0);
+	deva_add_announcer(&a2, radio2, &ctrl2, 0);
+
+	for(uint8_t i=0;i<7;i++) {
+		uint32_t timeout = unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&(packets_sent != 2)) {
+			test_errors++; // Both started and sent
+		}
+		if((i == 3)&&((timeout < 500)||(comms_status(radio1) != COMMS_STARTED))) {
+			test_errors++; // Listening after send-done, not polling
+		}
+		if((i == 4)&&((timeout < 1000)||(comms_status(radio1) != COMMS_STOPPED)||(comms_status(radio2) != COMMS_STARTED))) {
+			test_errors++; // Layer 1 sleeps, the stuck send keeps only layer 2 on
+		}
+		if((i == 6)&&(comms_status(radio2) != COMMS_STOPPED)) {
+			test_errors++; // Layer 2 sleeps after its own listen window
+		}
+		fake_localtime++;
+		fake_sends_complete(COMMS_SUCCESS);
+		if(i == 0) {
+			deliverRequestTo(radio1, 0x1234, 1, "\x10\x02", 2);
+			deliverRequestTo(radio2, 0x1234, 2, "\x10\x02", 2);
+		}
+		if(i == 1) {
+			fake_start_complete(radio1);
+			fake_start_complete(radio2);
+		}
+		if((i == 4)&&(fake_held.sdf != NULL)) {
+			fake_held.sdf(fake_held.comms, fake_held.msg, COMMS_SUCCESS, fake_held.user);
+		}
+	}
+
+	if(test_errors > 0) {
+		err1("testAwakeWindow - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+uint8_t send_failures = 0;
+uint8_t send_attempts = 0;
+
+comms_error_t fake_comms_send6(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	send_attempts++;
+	if(send_failures > 0) {
+		send_failures--;
+		return COMMS_EBUSY;
+	}
+	return fake_comms_send4(comms, msg, sdf, user);
+}
+
+int testSendRetry() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	send_failures = 2;
+	send_attempts = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send6, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<10;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 5) { // Too old by the time the channel is free again
+			send_failures = 10;
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+		}
+	}
+
+	if((packets_sent != 1)||(send_attempts != 3+3)) {
+		err1("testSendRetry - packet count: %d/%d != %d/%d", packets_sent, send_attempts, 1, 6);
+		return 1;
+	}
+
+	deva_stats_t stats;
+	if(!deva_get_stats(&announcer, &stats)) {
+		err1("testSendRetry - no stats");
+		return 1;
+	}
+	if((stats.queries != 1)||(stats.describes != 1)||(stats.send_failures != 5)||(stats.retries != 4)||(stats.stale != 1)) {
+		err1("testSendRetry - stats: %"PRIu32"/%"PRIu32"/%"PRIu32"/%"PRIu32"/%"PRIu32" != 1/1/5/4/1",
+		     stats.queries, stats.describes, stats.send_failures, stats.retries, stats.stale);
+		return 1;
+	}
+	if(stats.latency[DEVA_STATS_LATENCY_BUCKETS-1] != 1) { // Took 3 seconds to get through
+		err1("testSendRetry - latency: %"PRIu32, stats.latency[DEVA_STATS_LATENCY_BUCKETS-1]);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testSendRetry - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+comms_error_t fake_comms_send8(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	last_destination = comms_am_get_destination((comms_layer_t*)comms, msg);
+	return fake_comms_send6(comms, msg, sdf, user);
+}
+
+int testFailedResponseNotCached() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	send_failures = 0;
+	send_attempts = 0;
+	last_destination = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send8, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<7;i++) {
+		if(i == 2) {
+			send_failures = 3; // The broadcast answer never gets through
+		}
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&((send_attempts != 1)||(last_destination != 0xFFFF))) {
+			test_errors++; // Two broadcast requesters, one broadcast answer
+		}
+		if((i == 4)&&((send_attempts != 4)||(packets_sent != 1)||(last_destination != 0x1111))) {
+			test_errors++; // Not suppressed by the answer that was dropped
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 0) {
+			deliverRequest(radio, 0x1234, "\x11\x02", 2);
+			deliverRequest(radio, 0x4321, "\x11\x02", 2);
+		}
+		if(i == 2) {
+			deliverRequestTo(radio, 0x1111, 1, "\x11\x02", 2);
+		}
+	}
+
+	deva_stats_t stats;
+	deva_get_stats(&announcer, &stats);
+	if((stats.stale != 1)||(stats.suppressed != 0)) {
+		err1("testFailedResponseNotCached - stale %"PRIu32" suppressed %"PRIu32, stats.stale, stats.suppressed);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testFailedResponseNotCached - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+uint8_t stuck_sends = 0;
+
+comms_error_t fake_comms_send_stuck(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	stuck_sends++; // Accepted, but never completes
+	return COMMS_SUCCESS;
+}
+
+int testParallelSends() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	stuck_sends = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	uint8_t r2[512];
+	comms_layer_t* radio1 = (comms_layer_t*)r1;
+	comms_layer_t* radio2 = (comms_layer_t*)r2;
+	comms_am_create(radio1, 1, &fake_comms_send_stuck, &fake_comms_len, NULL, NULL);
+	comms_am_create(radio2, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+
+	devf_init();
+
+	device_announcer_t announcer1;
+	device_announcer_t announcer2;
+	deva_init(NULL);
+	deva_add_announcer(&announcer1, radio1, NULL, 0);
+	deva_add_announcer(&announcer2, radio2, NULL, 0);
+
+	for(uint8_t i=0;i<10;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 6)&&((stuck_sends != 1)||(announcer1.deferred_count != 1))) {
+			test_errors++; // Still waiting for send-done
+		}
+		if((i == 7)&&((stuck_sends != 2)||(announcer1.stats.stale != 1))) {
+			test_errors++; // Gave up on send-done after DEVA_SEND_DONE_TIMEOUT_MS
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio2, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio1, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 2) { // Other interface is not affected
+			deliverRequestTo(radio2, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 3) { // Waits for the stuck message
+			deliverRequestTo(radio1, 0x1234, 1, "\x11\x02", 2);
+		}
+	}
+
+	if((stuck_sends != 2)||(packets_sent != 1)) {
+		err1("testParallelSends - packet count: %d/%d != %d/%d", stuck_sends, packets_sent, 2, 1);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testParallelSends - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testDeferredRequests() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	fake_sends_pending = 0;
+	memset(&fake_held, 0, sizeof(fake_held));
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio1 = (comms_layer_t*)r1;
+	comms_am_create(radio1, 1, &fake_comms_send_held, &fake_comms_len, NULL, NULL);
+	uint8_t r2[512];
+	comms_layer_t* radio2 = (comms_layer_t*)r2;
+	comms_am_create(radio2, 2, &fake_comms_send_queued, &fake_comms_len, NULL, NULL);
+
+	devf_init();
+
+	device_announcer_t busy; // Send-done never comes
+	device_announcer_t other;
+	fake_send_t first;
+	deva_init(NULL);
+	deva_add_announcer(&busy, radio1, NULL, 0);
+	deva_add_announcer(&other, radio2, NULL, 0);
+
+	for(uint8_t i=0;i<8;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if(i == 1) {
+			first = fake_held;
+		}
+		if((i == 2)&&((busy.deferred_count != DEVA_DEFERRED_LENGTH)||(busy.stats.queue_overflows != 0)
+		            ||(other.deferred_count != 1)||(other.stats.queue_overflows != 0))) {
+			test_errors++; // Busy announcer fills only its own list, the rest waits in its ring
+		}
+		if((i == 6)&&((busy.deferred_count != 0)||(busy.stats.stale != 1 + DEVA_DEFERRED_LENGTH)
+		            ||(fake_held.msg == first.msg))) {
+			test_errors++; // Send-done timed out, old deferred requests dropped, ring request sent
+		}
+		fake_localtime++;
+		fake_sends_complete(COMMS_SUCCESS);
+		if(i == 0) {
+			deliverRequestTo(radio1, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 1) {
+			deliverRequestTo(radio1, 0x1001, 1, "\x12\x02\x00", 3);
+			deliverRequestTo(radio1, 0x1002, 1, "\x12\x02\x01", 3);
+			deliverRequestTo(radio1, 0x1003, 1, "\x13\x02", 2);
+			deliverRequestTo(radio1, 0x1004, 1, "\x15\x02", 2);
+			deliverRequestTo(radio1, 0x1005, 1, "\x11\x02", 2);
+			deliverRequestTo(radio2, 0x1234, AM_BROADCAST_ADDR, "\x10\x02", 2);
+		}
+	}
+
+	if(other.stats.queries != 1) {
+		err1("testDeferredRequests - other: %"PRIu32, other.stats.queries);
+		return 1;
+	}
+
+	// Late send-done of the abandoned message returns it to the pool
+	uint8_t taken = fake_pool_taken;
+	first.sdf(first.comms, first.msg, COMMS_SUCCESS, first.user);
+	if((fake_pool_taken != taken - 1)||(busy.msg_done)) {
+		err1("testDeferredRequests - orphan: %d %d", fake_pool_taken, (int)busy.msg_done);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testDeferredRequests - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+uint8_t last_payload[128];
+uint8_t last_length = 0;
+
+comms_error_t fake_comms_send7(comms_layer_iface_t* comms, comms_msg_t* msg, comms_send_done_f* sdf, void* user) {
+	comms_layer_t* c = (comms_layer_t*)comms;
+	last_length = comms_get_payload_length(c, msg);
+	memcpy(last_payload, comms_get_payload(c, msg, last_length), last_length);
+	return fake_comms_send5(comms, msg, sdf, user);
+}
+
+int testCoordinateChanges() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	last_length = 0;
+	fake_coordinates_known = false;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send7, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	const device_announcement_v2_t* da = (const device_announcement_v2_t*)last_payload;
+
+	for(uint8_t i=0;i<7;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&((packets_sent != 1)||(da->position_type != 'U')||(ntoh32(da->latitude) != 0))) {
+			test_errors++;
+		}
+		if((i == 5)&&((packets_sent != 2)||(da->position_type != 'G')||(ntoh32(da->latitude) != 59437000)
+		            ||(ntoh32(da->longitude) != 24745000)||(ntoh32(da->elevation) != 1200))) {
+			test_errors++; // Coordinates changed without deva_content_changed
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 3) {
+			fake_coordinates_known = true;
+		}
+		if(i == 4) {
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02", 2);
+		}
+	}
+
+	fake_coordinates_known = false;
+
+	if(test_errors > 0) {
+		err1("testCoordinateChanges - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testEmptyPool() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	fake_sends_pending = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_am_create(radio, 1, &fake_comms_send_queued, &fake_comms_len, NULL, NULL);
+
+	devf_init();
+
+	uint8_t taken = fake_pool_taken;
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 10);
+	bool reserved = (NULL != announcer.reserved); // DEVA_RESERVED_MESSAGES
+	fake_pool_limit = fake_pool_taken; // Nothing left for anyone
+
+	for(uint8_t i=0;i<5;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		fake_sends_complete(COMMS_SUCCESS);
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+		}
+	}
+	fake_pool_limit = 255;
+
+	deva_stats_t stats;
+	deva_get_stats(&announcer, &stats);
+	if(reserved) {
+		if((packets_sent != 3)||(stats.announcements != 2)||(stats.describes != 1)||(stats.pool_empty != 0)) {
+			err1("testEmptyPool - reserved: %d %"PRIu32" %"PRIu32, packets_sent, stats.announcements, stats.pool_empty);
+			return 1; // Announcements and the response all got through
+		}
+	}
+	else {
+		if((packets_sent != 0)||(stats.pool_empty == 0)) {
+			err1("testEmptyPool - unreserved: %d %"PRIu32, packets_sent, stats.pool_empty);
+			return 1;
+		}
+	}
+
+	deva_remove_announcer(&announcer);
+	if(fake_pool_taken != taken) {
+		err1("testEmptyPool - not returned: %d != %d", fake_pool_taken, taken);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testRemoveStuckSend() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	fake_sends_pending = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_am_create(radio, 1, &fake_comms_send_queued, &fake_comms_len, NULL, NULL);
+
+	devf_init();
+
+	uint8_t taken = fake_pool_taken;
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+	for(uint8_t i=0;i<3;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+	}
+	if((packets_sent != 1)||(fake_sends_pending != 1)) {
+		err1("testRemoveStuckSend - not sending: %d %d", packets_sent, fake_sends_pending);
+		return 1;
+	}
+
+	// The layer never completes, remove gives up after DEVA_REMOVE_TIMEOUT_MS
+	uint32_t start = fake_localtime;
+	if(!deva_remove_announcer(&announcer)) {
+		err1("testRemoveStuckSend - not removed");
+		return 1;
+	}
+	if(fake_localtime - start > 6) { // DEVA_REMOVE_TIMEOUT_MS is 5000 by default
+		err1("testRemoveStuckSend - waited %"PRIu32, fake_localtime - start);
+		return 1;
+	}
+	if(fake_pool_taken != taken + 1) {
+		err1("testRemoveStuckSend - in flight: %d != %d", fake_pool_taken, taken + 1);
+		return 1;
+	}
+
+	// The announcer memory is reused, send-done must not write into it
+	memset(&announcer, 0xEE, sizeof(announcer));
+	fake_sends_complete(COMMS_SUCCESS);
+	if(fake_pool_taken != taken) {
+		err1("testRemoveStuckSend - not returned: %d != %d", fake_pool_taken, taken);
+		return 1;
+	}
+	uint8_t* p = (uint8_t*)&announcer;
+	for(uint32_t i=0;i<sizeof(announcer);i++) {
+		if(p[i] != 0xEE) {
+			err1("testRemoveStuckSend - written at %"PRIu32, i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testStatistics() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	last_length = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send7, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<5;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02", 2);
+		}
+		if(i == 2) {
+			deliverRequestTo(radio, 0x1234, 1, "\x15\x02", 2);
+		}
+		if(i == 3) {
+			deliverRequestTo(radio, 0x1234, 1, "\x13\x02", 2);
+		}
+	}
+
+	if((packets_sent != 3)||(last_length != sizeof(device_statistics_t))) {
+		err1("testStatistics - packet count: %d/%d != %d/%d", packets_sent, last_length, 3, (int)sizeof(device_statistics_t));
+		return 1;
+	}
+
+	device_statistics_t* st = (device_statistics_t*)last_payload;
+	if((st->header != DEVA_STATISTICS)||(st->stats_version != DEVICE_STATISTICS_VERSION)) {
+		test_errors++;
+	}
+	if(ntoh32(st->responses) != 2) { // The query and the filter, the statistics response itself is not counted yet
+		test_errors++;
+	}
+	if((ntoh16(st->latency_p50) != 2500)||(ntoh16(st->latency_p99) != 2500)) { // Took a second
+		test_errors++;
+	}
+	if(ntoh16(st->stack_free) != 512) {
+		test_errors++;
+	}
+	deva_stats_t stats;
+	deva_get_stats(&announcer, &stats);
+	if((stats.queries != 1)||(stats.diagnostics != 2)) {
+		test_errors++;
+	}
+	if(test_errors > 0) {
+		err1("testStatistics - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testConditionalRequests() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	last_length = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send7, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<10;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&((packets_sent != 1)||(last_length != sizeof(device_not_modified_t))||(last_payload[0] != DEVA_NOT_MODIFIED)||(last_payload[14] != DEVA_DESCRIBE))) {
+			test_errors++; // Description has not changed
+		}
+		if((i == 4)&&((packets_sent != 2)||(last_payload[0] != DEVA_DESCRIPTION))) {
+			test_errors++; // Requester has an old description
+		}
+		if((i == 7)&&(packets_sent != 2)) {
+			test_errors++; // Broadcast and nothing has changed, stay silent
+		}
+		if((i == 9)&&((packets_sent != 3)||(last_payload[0] != DEVA_ANNOUNCEMENT))) {
+			test_errors++; // Features have changed
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02\x01\x02\x03\x04\x05\x06\x07\x08\x00\x00\x00\x00", 14);
+		}
+		if(i == 3) {
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02\x01\x02\x03\x04\x05\x06\x07\x07\x00\x00\x00\x00", 14);
+		}
+		if(i == 5) {
+			deliverRequest(radio, 0x4321, "\x12\x02\x00\x01\x02\x03\x04\x05\x06\x07\x08\x00\x00\x00\x00", 15);
+		}
+		if(i == 8) {
+			deliverRequestTo(radio, 0x1234, 1, "\x10\x02\x01\x02\x03\x04\x05\x06\x07\x08\x12\x34\x56\x78", 14);
+		}
+	}
+
+	if(test_errors > 0) {
+		err1("testConditionalRequests - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testConditionalAfterResponse() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	last_length = 0;
+	last_destination = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_am_create(radio, 1, &fake_comms_send7, &fake_comms_len, NULL, NULL);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<5;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 2)&&((packets_sent != 1)||(last_payload[0] != DEVA_DESCRIPTION)||(last_destination != 0x1234))) {
+			test_errors++; // Full answer to the first requester
+		}
+		if((i == 3)&&((packets_sent != 2)||(last_payload[0] != DEVA_NOT_MODIFIED)||(last_destination != 0x4321))) {
+			test_errors++; // Cached answer for 0x1234 must not make not-modified a broadcast
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x11\x02", 2);
+		}
+		if(i == 2) { // Within DEVA_RESPONSE_CACHE_MS
+			deliverRequestTo(radio, 0x4321, 1, "\x11\x02\x01\x02\x03\x04\x05\x06\x07\x08\x00\x00\x00\x00", 14);
+		}
+		if(i == 3) {
+			deliverRequestTo(radio, 0x4321, 1, "\x13\x02", 2);
+		}
+	}
+
+	device_statistics_t* st = (device_statistics_t*)last_payload;
+	if((st->header != DEVA_STATISTICS)||(ntoh32(st->responses) != 2)) {
+		test_errors++; // Not-modified is a response too
+	}
+
+	if(test_errors > 0) {
+		err1("testConditionalAfterResponse - errors: %"PRIu32" %04X", test_errors, last_destination);
+		return 1;
+	}
+
+	deva_remove_announcer(&announcer);
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testFilteredQuery() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+	device_feature_t dftrs[2];
+	devf_add_feature(&dftrs[0], (nx_uuid_t*)"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x10\x11\x12\x13\x14\x15\x16");
+	devf_add_feature(&dftrs[1], (nx_uuid_t*)"\x17\x18\x19\x20\x21\x22\x23\x24\x25\x26\x27\x28\x29\x30\x31\x32");
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<10;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if((i == 3)&&(packets_sent != 1)) {
+			test_errors++; // Application matches
+		}
+		if((i == 5)&&(packets_sent != 1)) {
+			test_errors++; // Other application
+		}
+		if((i == 7)&&(packets_sent != 2)) {
+			test_errors++; // Has the feature
+		}
+		if((i == 9)&&(packets_sent != 2)) {
+			test_errors++; // Does not have the feature
+		}
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequest(radio, 0x1234, "\x14\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 19);
+		}
+		if(i == 3) {
+			deliverRequest(radio, 0x1234, "\x14\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01", 19);
+		}
+		if(i == 5) {
+			deliverRequest(radio, 0x1234, "\x14\x02\x01\x17\x18\x19\x20\x21\x22\x23\x24\x25\x26\x27\x28\x29\x30\x31\x32", 19);
+		}
+		if(i == 7) {
+			deliverRequest(radio, 0x1234, "\x14\x02\x01\x33\x34\x35\x36\x37\x38\x39\x40\x41\x42\x43\x44\x45\x46\x47\x48", 19);
+		}
+	}
+
+	if(test_errors > 0) {
+		err1("testFilteredQuery - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testFeatureFilter() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	last_length = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send7, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	nx_uuid_t* f1 = (nx_uuid_t*)"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x10\x11\x12\x13\x14\x15\x16";
+	nx_uuid_t* f2 = (nx_uuid_t*)"\x17\x18\x19\x20\x21\x22\x23\x24\x25\x26\x27\x28\x29\x30\x31\x32";
+	nx_uuid_t* f3 = (nx_uuid_t*)"\x33\x34\x35\x36\x37\x38\x39\x40\x41\x42\x43\x44\x45\x46\x47\x48";
+
+	devf_init();
+	device_feature_t dftrs[2];
+	devf_add_feature(&dftrs[0], f1);
+	devf_add_feature(&dftrs[1], f2);
+
+	if((!devf_has_feature(f1))||(!devf_has_feature(f2))||(devf_has_feature(f3))) {
+		test_errors++;
+	}
+
+	devf_remove_feature(&dftrs[0]);
+
+	uint8_t filter[DEVF_FILTER_BYTES];
+	devf_get_filter(filter, NULL);
+	if((devf_has_feature(f1))||(!feature_filter_test(filter, sizeof(filter), f2))||(feature_filter_test(filter, sizeof(filter), f1))) {
+		test_errors++; // Filter is rebuilt on remove
+	}
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+
+	for(uint8_t i=0;i<4;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 1) {
+			deliverRequestTo(radio, 0x1234, 1, "\x15\x02", 2);
+		}
+	}
+
+	device_feature_filter_t* ff = (device_feature_filter_t*)last_payload;
+	if((packets_sent != 1)||(last_length != sizeof(device_feature_filter_t) + DEVF_FILTER_BYTES)
+	 ||(ff->header != DEVA_FEATURE_FILTER)||(ff->count != 1)||(0 != memcmp(ff->filter, filter, sizeof(filter)))) {
+		err1("testFeatureFilter - packet: %d/%d", packets_sent, last_length);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testFeatureFilter - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+uint8_t announcements_heard = 0;
+
+void announcement_listener(const device_announcement_t* announcement, am_addr_t source, void* user) {
+	debugb1("heard %04X", announcement, sizeof(device_announcement_t), source);
+	announcements_heard++;
+	if((source != 0x4321)||(user != &announcements_heard)) {
+		test_errors++;
+	}
+	if((announcement->version != 2)||(memcmp(announcement->guid, "\x01\x02\x03\x04\x05\x06\x07\x08", 8) != 0)) {
+		test_errors++;
+	}
+}
+
+int testAnnouncementListener() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	announcements_heard = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	device_announcer_t announcer;
+	device_announcement_listener_t listener;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+	deva_add_listener(&listener, announcement_listener, &announcements_heard);
+
+	device_announcement_v2_t da2;
+	memset(&da2, 0, sizeof(da2));
+	da2.version = 2;
+	memcpy(da2.guid, "\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+
+	device_announcement_v1_t da1;
+	memset(&da1, 0, sizeof(da1));
+	da1.version = 1;
+	memcpy(da1.guid, "\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+
+	for(uint8_t i=0;i<10;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(i == 2) {
+			deliverRequest(radio, 0x4321, (const char*)&da2, sizeof(da2));
+		}
+		if(i == 4) {
+			deliverRequest(radio, 0x4321, (const char*)&da1, sizeof(da1));
+		}
+		if(i == 6) {
+			deliverRequest(radio, 0x4321, (const char*)&da2, sizeof(da2) - 1); // Too short
+			deva_remove_listener(&listener);
+			deliverRequest(radio, 0x4321, (const char*)&da2, sizeof(da2));
+		}
+	}
+
+	if(announcements_heard != 2) {
+		err1("testAnnouncementListener - heard: %d != %d", announcements_heard, 2);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testAnnouncementListener - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+device_announcement_t last_heard;
+
+void copying_listener(const device_announcement_t* announcement, am_addr_t source, void* user) {
+	announcements_heard++;
+	memcpy(&last_heard, announcement, sizeof(last_heard));
+}
+
+int testAnnouncementDecoding() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	announcements_heard = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	device_announcer_t announcer;
+	device_announcement_listener_t listener;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+	deva_add_listener(&listener, copying_listener, NULL);
+
+	device_announcement_v1_t da1;
+	memset(&da1, 0, sizeof(da1));
+	da1.version = 1;
+	memcpy(da1.guid, "\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+	da1.boot_number = hton32(3);
+	da1.announcement = hton32(7);
+	da1.latitude = hton32(59437000);
+	da1.longitude = hton32(24745000);
+	da1.elevation = hton32(1200);
+	da1.ident_timestamp = hton64(0x0102030405060708);
+	da1.feature_list_hash = hton32(0x12345678);
+
+	device_announcement_v2_t da3;
+	memset(&da3, 0, sizeof(da3));
+	da3.version = 3; // Unknown version
+
+	for(uint8_t i=0;i<6;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		if(i == 2) {
+			if(announcements_heard != 1) {
+				test_errors++;
+			}
+			if((last_heard.version != 2)||(last_heard.position_type != 'U')||(last_heard.radio_tech != 0)) {
+				test_errors++; // Not upgraded
+			}
+			if((ntoh32(last_heard.boot_number) != 3)||(ntoh32(last_heard.announcement) != 7)
+			 ||(ntoh32(last_heard.latitude) != 59437000)||(ntoh32(last_heard.longitude) != 24745000)
+			 ||(ntoh32(last_heard.elevation) != 1200)||(ntoh64(last_heard.ident_timestamp) != 0x0102030405060708)
+			 ||(ntoh32(last_heard.feature_list_hash) != 0x12345678)) {
+				test_errors++; // Fields lost in the upgrade
+			}
+		}
+		fake_localtime++;
+		if(i == 1) {
+			deliverRequest(radio, 0x4321, (const char*)&da1, sizeof(da1));
+		}
+		if(i == 3) {
+			deliverRequest(radio, 0x4321, (const char*)&da1, sizeof(da1) - 1); // Too short
+			deliverRequest(radio, 0x4321, (const char*)&da3, sizeof(da3));
+			deliverRequest(radio, 0x4321, "\x01\x02\x00", 3); // Description, not used locally
+		}
+	}
+
+	if(announcements_heard != 1) {
+		err1("testAnnouncementDecoding - heard: %d != %d", announcements_heard, 1);
+		return 1;
+	}
+	if(packets_sent != 0) {
+		err1("testAnnouncementDecoding - packets: %d != %d", packets_sent, 0);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testAnnouncementDecoding - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	deva_remove_listener(&listener);
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testFeatureManagement() {
+	devf_init();
+	device_feature_t dftrs[4];
+
+	devf_add_feature(&dftrs[0], (nx_uuid_t*)"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x10\x11\x12\x13\x14\x15\x16");
+	if(devf_count() != 1) {
+		return 1;
+	}
+	if(devf_hash() != 0xa4446403) {
+		return 2;
+	}
+
+	devf_add_feature(&dftrs[1], (nx_uuid_t*)"\x17\x18\x19\x20\x21\x22\x23\x24\x25\x26\x27\x28\x29\x30\x31\x32");
+	if(devf_count() != 2) {
+		return 1;
+	}
+	if(devf_hash() != 0x698e3b4f) {
+		return 2;
+	}
+
+	devf_add_feature(&dftrs[2], (nx_uuid_t*)"\x33\x34\x35\x36\x37\x38\x39\x40\x41\x42\x43\x44\x45\x46\x47\x48");
+	if(devf_count() != 3) {
+		return 1;
+	}
+	if(devf_hash() != 0x35433a5d) {
+		return 2;
+	}
+
+	devf_add_feature(&dftrs[3], (nx_uuid_t*)"\x49\x50\x51\x52\x53\x54\x55\x56\x57\x58\x59\x60\x61\x62\x63\x64");
+	if(devf_count() != 4) {
+		return 1;
+	}
+	if(devf_hash() != 0x30cf0ca5) {
+		return 2;
+	}
+
+	nx_uuid_t uuids[5];
+	if(devf_get_features(1, uuids, 2, NULL) != 2) {
+		return 3;
+	}
+	if((memcmp(&uuids[0], &dftrs[1].uuid, sizeof(nx_uuid_t)) != 0)||(memcmp(&uuids[1], &dftrs[2].uuid, sizeof(nx_uuid_t)) != 0)) {
+		return 3;
+	}
+	if(devf_get_features(3, uuids, 5, NULL) != 1) { // Only the last one is left
+		return 3;
+	}
+	if(memcmp(&uuids[0], &dftrs[3].uuid, sizeof(nx_uuid_t)) != 0) {
+		return 3;
+	}
+	devf_info_t info;
+	if(devf_get_features(0, uuids, 5, &info) != 4) { // All of them
+		return 3;
+	}
+	if((info.count != 4)||(info.hash != 0x30cf0ca5)) {
+		return 3;
+	}
+
+	devf_remove_feature(&dftrs[1]); // Remove second element
+	if(devf_count() != 3) {
+		return 1;
+	}
+	if(devf_hash() != 0xfbbf7241) {
+		return 2;
+	}
+
+	devf_remove_feature(&dftrs[0]); // Remove first element
+	if(devf_count() != 2) {
+		return 1;
+	}
+	if(devf_hash() != 0x165901bf) {
+		return 2;
+	}
+
+	devf_remove_feature(&dftrs[3]); // Remove last element
+	if(devf_count() != 1) {
+		return 1;
+	}
+	if(devf_hash() != 0xb25972e7) {
+		return 2;
+	}
+
+	devf_add_feature(&dftrs[0], (nx_uuid_t*)"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x10\x11\x12\x13\x14\x15\x16");
+	if(devf_hash() != 0x2277d01) { // Order matters
+		return 2;
+	}
+	devf_remove_feature(&dftrs[0]);
+
+	devf_remove_feature(&dftrs[2]); // Remove the only remaining element
+	if(devf_count() != 0) {
+		return 1;
+	}
+	if(devf_hash() != 0) {
+		return 2;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+atomic_bool readers_stop;
+atomic_uint reader_errors;
+atomic_uint reader_passes;
+
+void* feature_reader(void* arg) {
+	nx_uuid_t uuids[DEVF_MAX_FEATURES];
+	while(!atomic_load(&readers_stop)) {
+		devf_info_t info;
+		uint8_t count = devf_get_features(0, uuids, DEVF_MAX_FEATURES, &info);
+		if(count != info.count) {
+			atomic_fetch_add(&reader_errors, 1);
+		}
+		for(uint8_t i=0;i<count;i++) {
+			const uint8_t* u = (const uint8_t*)&uuids[i];
+			if((u[0] == 0)||(u[0] > 4)||(memcmp(u, u + 1, sizeof(nx_uuid_t) - 1) != 0)) {
+				atomic_fetch_add(&reader_errors, 1); // Not a UUID that was ever added
+			}
+		}
+		nx_uuid_t never;
+		memset(&never, 0xFF, sizeof(never));
+		if(devf_has_feature(&never)) { // Same lock-free path as filtered queries in radio_receive
+			atomic_fetch_add(&reader_errors, 1);
+		}
+		devf_has_feature(&uuids[0]);
+		atomic_fetch_add(&reader_passes, 1);
+	}
+	return NULL;
+}
+
+int testFeatureSnapshots() {
+	devf_init();
+	atomic_store(&readers_stop, false);
+	atomic_store(&reader_errors, 0);
+	atomic_store(&reader_passes, 0);
+
+	pthread_t reader;
+	pthread_create(&reader, NULL, feature_reader, NULL);
+
+	device_feature_t dftrs[4];
+	nx_uuid_t uuid;
+	for(uint32_t i=0;i<20000;i++) {
+		uint8_t k = i % 4;
+		memset(&uuid, k + 1, sizeof(uuid));
+		devf_add_feature(&dftrs[k], &uuid);
+		if(i >= 2) {
+			uint8_t r = (i - 2) % 4;
+			devf_remove_feature(&dftrs[r]);
+			memset(&dftrs[r], 0xEE, sizeof(device_feature_t)); // Memory is free after remove
+		}
+	}
+
+	atomic_store(&readers_stop, true);
+	pthread_join(reader, NULL);
+
+	if((devf_count() != 2)||(devf_add_feature(&dftrs[0], &uuid) != false)) {
+		return 1;
+	}
+	if(atomic_load(&reader_errors) != 0) {
+		err1("testFeatureSnapshots - errors: %u passes: %u", atomic_load(&reader_errors), atomic_load(&reader_passes));
+		return 1;
+	}
+
+	device_feature_t many[DEVF_MAX_FEATURES + 1];
+	devf_init();
+	for(uint8_t i=0;i<DEVF_MAX_FEATURES;i++) {
+		memset(&uuid, i + 1, sizeof(uuid));
+		if(!devf_add_feature(&many[i], &uuid)) {
+			return 2;
+		}
+	}
+	memset(&uuid, 0xFF, sizeof(uuid));
+	if(devf_add_feature(&many[DEVF_MAX_FEATURES], &uuid) || (devf_count() != DEVF_MAX_FEATURES)) {
+		return 2; // Full
+	}
+	devf_init();
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testTrickleAnnouncements() {
+	// Test setup
+	fake_localtime = 0;
+	packets_sent = 0;
+	test_errors = 0;
+	//-----------
+
+	printf("------------------------------------------------------------------------\n");
+
+	uint8_t r1[512];
+	comms_layer_t* radio = (comms_layer_t*)r1;
+	comms_error_t err = comms_am_create(radio, 1, &fake_comms_send4, &fake_comms_len, NULL, NULL);
+	printf("create radio=%d\n", err);
+
+	devf_init();
+
+	device_announcer_t announcer;
+	deva_init(NULL);
+	deva_add_announcer(&announcer, radio, NULL, 0);
+	if( ! deva_set_trickle(&announcer, 4, 16, 1)) {
+		return 1;
+	}
+
+	device_announcement_v2_t da2;
+	memset(&da2, 0, sizeof(da2));
+	da2.version = 2;
+	memcpy(da2.guid, "\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+
+	for(uint8_t i=0;i<116;i++) {
+		unittest_process_announcements (osThreadFlagsWait(0x7FFFFFFF, 0, 0));
+		fake_localtime++;
+		if(_sdf1 != NULL) {
+			_sdf1(radio, _msg1, COMMS_SUCCESS, _user1);
+			_sdf1 = NULL;
+		}
+		if(i == 62) { // Intervals 4, 8, 16, 16, 16 have passed
+			if(packets_sent != 5) {
+				err1("testTrickleAnnouncements - quiet count: %d != %d", packets_sent, 5);
+				return 1;
+			}
+		}
+		if((i >= 63)&&(i < 103)) { // Neighbors new to the table do not reset, but suppress
+			da2.guid[7] = i;
+			deliverRequest(radio, 0x4000 + i, (const char*)&da2, sizeof(da2));
+		}
+		if(i == 103) {
+			if((packets_sent != 5)||(announcer.trickle_interval != 16)) {
+				err1("testTrickleAnnouncements - suppressed count: %d != %d, %"PRIu32, packets_sent, 5, announcer.trickle_interval);
+				return 1;
+			}
+			da2.boot_number = hton32(1); // A known neighbor has restarted
+			deliverRequest(radio, 0x4000 + 102, (const char*)&da2, sizeof(da2));
+		}
+		if(i == 109) {
+			if((packets_sent != 6)||(announcer.trickle_interval > 8)) {
+				err1("testTrickleAnnouncements - restart count: %d != %d, %"PRIu32, packets_sent, 6, announcer.trickle_interval);
+				return 1;
+			}
+			deva_content_changed();
+		}
+	}
+
+	if(packets_sent != 7) {
+		err1("testTrickleAnnouncements - packet count: %d != %d", packets_sent, 7);
+		return 1;
+	}
+	if(test_errors > 0) {
+		err1("testTrickleAnnouncements - errors: %"PRIu32, test_errors);
+		return 1;
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+int testNeighborTable() {
+	device_announcement_t da;
+	device_neighbor_t nb;
+	uint8_t index = 0;
+	uint8_t count = 0;
+
+	fake_localtime = 0;
+	devn_init();
+
+	memset(&da, 0, sizeof(da));
+	da.version = 2;
+	da.boot_number = hton32(1);
+
+	for(uint8_t i=0;i<DEVN_CAPACITY+4;i++) {
+		da.guid[7] = i;
+		if(devn_update(&da, 0x100+i) != DEVN_CHANGED_NEW) {
+			return 1;
+		}
+		fake_localtime++;
+	}
+	if(devn_count() != DEVN_CAPACITY) {
+		return 2;
+	}
+
+	da.guid[7] = 0; // Oldest entries have been evicted
+	if(devn_get(da.guid, NULL)) {
+		return 3;
+	}
+	da.guid[7] = DEVN_CAPACITY+3;
+	if(( ! devn_get(da.guid, &nb))||(nb.address != 0x100+DEVN_CAPACITY+3)||(nb.boot_number != 1)) {
+		return 4;
+	}
+
+	if(devn_update(&da, 0x100+DEVN_CAPACITY+3) != 0) { // Nothing has changed
+		return 5;
+	}
+	da.boot_number = hton32(2);
+	da.feature_list_hash = hton32(0x12345678);
+	if(devn_update(&da, 0x100+DEVN_CAPACITY+3) != (DEVN_CHANGED_BOOT|DEVN_CHANGED_FEATURES)) {
+		return 6;
+	}
+
+	while(devn_next(&index, &nb)) {
+		count++;
+	}
+	if(count != DEVN_CAPACITY) {
+		return 7;
+	}
+
+	fake_localtime += 5;
+	if((devn_expire(10) != DEVN_CAPACITY - 5)||(devn_count() != 5)) {
+		return 8;
+	}
+	for(uint8_t i=DEVN_CAPACITY-1;i<DEVN_CAPACITY+4;i++) { // Survivors can still be found
+		da.guid[7] = i;
+		if( ! devn_get(da.guid, NULL)) {
+			return 9;
+		}
+	}
+
+	// Random clusters, some wrap around the end of the table
+	srand(1);
+	for(uint16_t trial=0;trial<500;trial++) {
+		uint8_t expired = 0;
+		devn_init();
+		for(uint8_t i=0;i<DEVN_CAPACITY;i++) {
+			for(uint8_t j=0;j<8;j++) {
+				da.guid[j] = rand();
+			}
+			fake_localtime = 100 + rand() % 20;
+			if(devn_update(&da, i) != DEVN_CHANGED_NEW) {
+				return 10;
+			}
+			if(fake_localtime < 110) {
+				expired++;
+			}
+		}
+		fake_localtime = 120;
+		if(devn_expire(10) != expired) {
+			return 11;
+		}
+		index = 0;
+		count = 0;
+		while(devn_next(&index, &nb)) {
+			if((nb.last_seen < 110)||(!devn_get(nb.guid, NULL))) {
+				return 12; // Expired entry was missed or a survivor can't be found
+			}
+			count++;
+		}
+		if((count != DEVN_CAPACITY - expired)||(devn_count() != count)) {
+			return 13;
+		}
+	}
+
+	return 0;
+}
+//------------------------------------------------------------------------------
+
 int main() {
 	int results = 0;
 	debug1("tests start");
 
 	results += testPeriodicAnnouncements();
+	results += testDeadlineScheduling();
 	results += testDescriptionResponse();
 	results += testListFeaturesResponse();
+	results += testQueryCoalescing();
+	results += testRequestRing();
+	results += testRequestRingThreads();
+	results += testBroadcastBackoff();
+	results += testResponseCache();
+	results += testRateLimit();
+	results += testListenWindow();
+	results += testLateLayerStart();
+	results += testSharedController();
+	results += testAwakeWindow();
+	results += testSendRetry();
+	results += testFailedResponseNotCached();
+	results += testParallelSends();
+	results += testDeferredRequests();
+	results += testCoordinateChanges();
+	results += testEmptyPool();
+	results += testRemoveStuckSend();
+	results += testStatistics();
+	results += testConditionalRequests();
+	results += testConditionalAfterResponse();
+	results += testFilteredQuery();
+	results += testFeatureFilter();
+	results += testAnnouncementListener();
+	results += testAnnouncementDecoding();
+	results += testTrickleAnnouncements();
 	results += testFeatureManagement();
+	results += testFeatureSnapshots();
+	results += testNeighborTable();
 
 	if(results != 0) {
 		err1("%d failures", results);
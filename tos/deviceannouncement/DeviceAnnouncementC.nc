@@ -50,9 +50,6 @@ implementation {
 	components RandomC;
 	DeviceAnnouncementP.Random -> RandomC;
 
-	components CrcC;
-	DeviceAnnouncementP.Crc -> CrcC;
-
 	components GlobalPoolC;
 	DeviceAnnouncementP.MessagePool -> GlobalPoolC;
 
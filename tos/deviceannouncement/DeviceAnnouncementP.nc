@@ -8,6 +8,7 @@
 #include "Coordinates.h"
 #include "DeviceSignature.h"
 #include "DeviceAnnouncementProtocol.h"
+#include "DeviceFeatureListHash.h"
 generic module DeviceAnnouncementP(uint8_t ifaces, uint8_t total_features) {
 	provides interface DeviceAnnouncement;
 	uses {
@@ -28,7 +29,6 @@ generic module DeviceAnnouncementP(uint8_t ifaces, uint8_t total_features) {
 
 		interface Timer<TMilli>;
 		interface Random;
-		interface Crc;
 
 		// Compile-time UUID fallback for older device signatures
 		interface GetStruct<uuid_t> as PlatformUuid128;
@@ -88,16 +88,23 @@ implementation {
 		return ftrs;
 	}
 
-	uint32_t featureListHash() { // Really simple hashing for now
-		uint16_t hash = 0;
+	uint32_t featureListHash() { // See DeviceFeatureListHash.h
+		uint32_t hash = DEVICE_FEATURE_LIST_HASH_OFFSET;
+		bool empty = TRUE;
 		uint8_t ftrs;
 		for(ftrs=0;ftrs<total_features;ftrs++) {
 			uuid_t uuid;
 			if(call DeviceFeatureUuid128.get[ftrs](&uuid) == SUCCESS) {
-				hash = call Crc.seededCrc16(hash, &uuid, sizeof(uuid));
+				nx_uuid_t nxuuid;
+				hton_uuid(&nxuuid, &uuid);
+				hash = feature_list_hash_add(hash, &nxuuid);
+				empty = FALSE;
 			}
 		}
-		return (((uint32_t)hash)<<16) + hash;
+		if(empty) {
+			return DEVICE_FEATURE_LIST_HASH_EMPTY;
+		}
+		return hash;
 	}
 
 	error_t announce(uint8_t iface, uint8_t version, am_addr_t destination) {